@@ -0,0 +1,311 @@
+/*
+ * Write-back buffer cache.
+ * See bcache.h for more information.
+ */
+
+#include <assert.h>
+#include "testfs.h"
+#include "bcache.h"
+#include "dev.h"
+#include "ioq.h"
+#include "list.h"
+
+/* buffer flags */
+#define B_DIRTY 0x1
+
+struct buf {
+	int b_nr;
+	int b_flags;
+	struct hlist_node b_hnode;
+	struct list_head b_lru;         /* most recently used first */
+	char b_data[];                  /* bc->block_size bytes */
+};
+
+#define BCACHE_HASH_SHIFT 10
+
+#define bcache_hashfn(nr)	\
+	hash_int((unsigned int)nr, BCACHE_HASH_SHIFT)
+
+static const int bcache_hash_size = (1 << BCACHE_HASH_SHIFT);
+
+struct bcache {
+	struct block_dev *dev;
+	int block_size;
+	int nr_bufs;                    /* capacity */
+	int nr_used;
+	struct list_head lru;
+	struct hlist_head *hash;
+	struct ioq rq;                  /* coalesces reads and bulk writes */
+	struct ioq wq;                  /* coalesces write back */
+};
+
+/*
+ * transfers of more than a quarter of the cache (e.g., reading the
+ * checksum table at mount time, or zeroing the inode blocks at mkfs time)
+ * go straight to the device, so they do not push out the working set.
+ */
+static inline int bcache_is_bulk(struct bcache *bc, int nr) {
+	return nr > bc->nr_bufs / 4;
+}
+
+static void bcache_dev_write(struct bcache *bc, const char *blocks,
+		int start, int nr) {
+	int ret;
+
+	if (blocks) {
+		ret = bc->dev->ops->write(bc->dev, blocks,
+				(off_t) start * bc->block_size,
+				(size_t) nr * bc->block_size);
+	} else {
+		ret = bc->dev->ops->zero(bc->dev, (off_t) start * bc->block_size,
+				(size_t) nr * bc->block_size);
+	}
+	if (ret < 0) {
+		errno = -ret;
+		EXIT("write");
+	}
+}
+
+static struct buf *
+bcache_find(struct bcache *bc, int nr) {
+	struct hlist_node *elem;
+	struct buf *b;
+
+	hlist_for_each_entry(b, elem, &bc->hash[bcache_hashfn(nr)], b_hnode)
+	{
+		if (b->b_nr == nr) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/* evicting a dirty buffer writes back all dirty buffers in one batch, so
+ * that a long run of writes does not turn into one synchronous device
+ * write per evicted block */
+static void bcache_evict(struct bcache *bc, struct buf *b) {
+	if (b->b_flags & B_DIRTY)
+		bcache_flush(bc);
+	hlist_del(&b->b_hnode);
+	list_del(&b->b_lru);
+	bc->nr_used--;
+	free(b);
+}
+
+/* move buffer to the head of the lru list */
+static void bcache_touch(struct bcache *bc, struct buf *b) {
+	list_del(&b->b_lru);
+	list_add(&b->b_lru, &bc->lru);
+}
+
+/* return the buffer for block nr, allocating one (without reading its
+ * contents) if the block is not cached. returns NULL if caching is
+ * disabled. */
+static struct buf *
+bcache_get(struct bcache *bc, int nr) {
+	struct buf *b;
+
+	if ((b = bcache_find(bc, nr)) != NULL) {
+		bcache_touch(bc, b);
+		return b;
+	}
+	if (bc->nr_bufs == 0)
+		return NULL;
+	if (bc->nr_used >= bc->nr_bufs) {
+		bcache_evict(bc, list_entry(bc->lru.prev, struct buf, b_lru));
+	}
+	if ((b = malloc(sizeof(struct buf) + bc->block_size)) == NULL) {
+		EXIT("malloc");
+	}
+	b->b_nr = nr;
+	b->b_flags = 0;
+	INIT_HLIST_NODE(&b->b_hnode);
+	hlist_add_head(&b->b_hnode, &bc->hash[bcache_hashfn(nr)]);
+	list_add(&b->b_lru, &bc->lru);
+	bc->nr_used++;
+	return b;
+}
+
+/* return negative value on error */
+int bcache_create(struct block_dev *dev, int block_size, int nr_bufs,
+		struct bcache **bcp) {
+	struct bcache *bc;
+	int i;
+
+	assert(nr_bufs >= 0);
+	bc = malloc(sizeof(struct bcache));
+	if (bc == NULL) {
+		return -ENOMEM;
+	}
+	bc->hash = malloc(bcache_hash_size * sizeof(struct hlist_head));
+	if (bc->hash == NULL) {
+		free(bc);
+		return -ENOMEM;
+	}
+	for (i = 0; i < bcache_hash_size; i++) {
+		INIT_HLIST_HEAD(&bc->hash[i]);
+	}
+	INIT_LIST_HEAD(&bc->lru);
+	ioq_init(&bc->rq, dev, block_size);
+	ioq_init(&bc->wq, dev, block_size);
+	bc->dev = dev;
+	bc->block_size = block_size;
+	bc->nr_bufs = nr_bufs;
+	bc->nr_used = 0;
+	*bcp = bc;
+	return 0;
+}
+
+void bcache_destroy(struct bcache *bc) {
+	bcache_resize(bc, 0);
+	assert(list_empty(&bc->lru));
+	ioq_destroy(&bc->rq);
+	ioq_destroy(&bc->wq);
+	free(bc->hash);
+	free(bc);
+}
+
+/* read the blocks queued in bc->rq from the device and keep copies of
+ * them in the cache */
+static void bcache_fill(struct bcache *bc) {
+	struct ioq *q = &bc->rq;
+	struct buf *b;
+	int i;
+
+	ioq_submit(q, 0);
+	if (!bcache_is_bulk(bc, q->cnt)) {
+		for (i = 0; i < q->cnt; i++) {
+			b = bcache_get(bc, q->reqs[i].bv_nr);
+			memcpy(b->b_data, q->reqs[i].bv_data, bc->block_size);
+		}
+	}
+	ioq_reset(q);
+}
+
+static void bcache_put(struct bcache *bc, struct buf *b, const char *data) {
+	if (data)
+		memcpy(b->b_data, data, bc->block_size);
+	else
+		bzero(b->b_data, bc->block_size);
+}
+
+void bcache_read(struct bcache *bc, char *blocks, int start, int nr) {
+	struct buf *b;
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if ((b = bcache_find(bc, start + i)) != NULL) {
+			memcpy(blocks + i * bc->block_size, b->b_data,
+					bc->block_size);
+			bcache_touch(bc, b);
+		} else {
+			ioq_add(&bc->rq, start + i, blocks + i * bc->block_size);
+		}
+	}
+	bcache_fill(bc);
+}
+
+void bcache_readv(struct bcache *bc, struct block_vec *vec, int cnt) {
+	struct buf *b;
+	int i;
+
+	for (i = 0; i < cnt; i++) {
+		if ((b = bcache_find(bc, vec[i].bv_nr)) != NULL) {
+			memcpy(vec[i].bv_data, b->b_data, bc->block_size);
+			bcache_touch(bc, b);
+		} else {
+			ioq_add(&bc->rq, vec[i].bv_nr, vec[i].bv_data);
+		}
+	}
+	bcache_fill(bc);
+}
+
+void bcache_write(struct bcache *bc, const char *blocks, int start, int nr) {
+	struct buf *b;
+	int i;
+
+	if (bcache_is_bulk(bc, nr)) {
+		/* write through, keeping cached copies up to date */
+		bcache_dev_write(bc, blocks, start, nr);
+		for (i = 0; i < nr; i++) {
+			if ((b = bcache_find(bc, start + i)) == NULL)
+				continue;
+			bcache_put(bc, b,
+					blocks ? blocks + i * bc->block_size : NULL);
+			b->b_flags &= ~B_DIRTY;
+		}
+		return;
+	}
+	for (i = 0; i < nr; i++) {
+		b = bcache_get(bc, start + i);
+		assert(b);
+		bcache_put(bc, b, blocks ? blocks + i * bc->block_size : NULL);
+		b->b_flags |= B_DIRTY;
+	}
+}
+
+void bcache_writev(struct bcache *bc, struct block_vec *vec, int cnt) {
+	struct buf *b;
+	int i;
+
+	if (bcache_is_bulk(bc, cnt)) {
+		/* write through, keeping cached copies up to date */
+		for (i = 0; i < cnt; i++) {
+			ioq_add(&bc->rq, vec[i].bv_nr, vec[i].bv_data);
+			if ((b = bcache_find(bc, vec[i].bv_nr)) == NULL)
+				continue;
+			bcache_put(bc, b, vec[i].bv_data);
+			b->b_flags &= ~B_DIRTY;
+		}
+		ioq_submit(&bc->rq, 1);
+		ioq_reset(&bc->rq);
+		return;
+	}
+	for (i = 0; i < cnt; i++) {
+		b = bcache_get(bc, vec[i].bv_nr);
+		assert(b);
+		bcache_put(bc, b, vec[i].bv_data);
+		b->b_flags |= B_DIRTY;
+	}
+}
+
+/* at most half of the cache is filled, so that the buffers allocated here
+ * cannot evict each other before they are read */
+void bcache_prefetch(struct bcache *bc, struct block_vec *vec, int cnt) {
+	struct buf *b;
+	int i;
+
+	cnt = MIN(cnt, bc->nr_bufs / 2);
+	for (i = 0; i < cnt; i++) {
+		if (bcache_find(bc, vec[i].bv_nr) != NULL)
+			continue;
+		b = bcache_get(bc, vec[i].bv_nr);
+		ioq_add(&bc->rq, b->b_nr, b->b_data);
+	}
+	ioq_submit(&bc->rq, 0);
+	ioq_reset(&bc->rq);
+}
+
+/* dirty buffers are written in block order, adjacent ones with a single
+ * device request */
+void bcache_flush(struct bcache *bc) {
+	struct buf *b;
+
+	list_for_each_entry(b, &bc->lru, b_lru)
+	{
+		if (b->b_flags & B_DIRTY) {
+			ioq_add(&bc->wq, b->b_nr, b->b_data);
+			b->b_flags &= ~B_DIRTY;
+		}
+	}
+	ioq_submit(&bc->wq, 1);
+	ioq_reset(&bc->wq);
+}
+
+void bcache_resize(struct bcache *bc, int nr_bufs) {
+	assert(nr_bufs >= 0);
+	bc->nr_bufs = nr_bufs;
+	while (bc->nr_used > nr_bufs) {
+		bcache_evict(bc, list_entry(bc->lru.prev, struct buf, b_lru));
+	}
+}
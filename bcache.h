@@ -0,0 +1,45 @@
+#ifndef _BCACHE_H
+#define _BCACHE_H
+
+/*
+ * Write-back buffer cache for file system blocks.
+ *
+ * Sits between block.c and the block device. Reads are served from cached
+ * buffers when possible, writes only update the cached copy and mark it
+ * dirty. Dirty buffers reach the device when they are evicted (least
+ * recently used first) or when the cache is flushed, which happens at
+ * every transaction commit and at unmount.
+ *
+ * Functions:
+ *     bcache_create  - create a cache of at most nr_bufs buffers of
+ *                      block_size bytes on dev.
+ *                      Returns negative value on error.
+ *     bcache_destroy - flush and free the cache.
+ *     bcache_read    - read blocks through the cache.
+ *     bcache_readv   - scatter/gather variant of bcache_read.
+ *     bcache_write   - write blocks into the cache. NULL data writes zeroes.
+ *     bcache_writev  - scatter/gather variant of bcache_write.
+ *     bcache_prefetch - read blocks that are not cached yet into the cache,
+ *                      in one batch. bv_data is ignored.
+ *     bcache_flush   - write all dirty buffers back to the device.
+ *     bcache_resize  - change the capacity. 0 disables caching.
+ */
+
+#define BCACHE_DEFAULT_NR_BUFS 64
+
+struct block_dev;
+struct block_vec;
+struct bcache;
+
+int  bcache_create(struct block_dev *dev, int block_size, int nr_bufs,
+                   struct bcache **bcp);
+void bcache_destroy(struct bcache *bc);
+void bcache_read(struct bcache *bc, char *blocks, int start, int nr);
+void bcache_readv(struct bcache *bc, struct block_vec *vec, int cnt);
+void bcache_write(struct bcache *bc, const char *blocks, int start, int nr);
+void bcache_writev(struct bcache *bc, struct block_vec *vec, int cnt);
+void bcache_prefetch(struct bcache *bc, struct block_vec *vec, int cnt);
+void bcache_flush(struct bcache *bc);
+void bcache_resize(struct bcache *bc, int nr_bufs);
+
+#endif /* _BCACHE_H */
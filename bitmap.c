@@ -7,6 +7,7 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <endian.h>
 #include "bitmap.h"
 #include "testfs.h"
 
@@ -16,79 +17,353 @@
  * because if one uses any data type more than a single byte wide,
  * bitmap data saved on disk becomes endian-dependent, which is a
  * severe nuisance.
+ *
+ * Scans still look at 64 bits at a time: a chunk is 8 bytes loaded as a
+ * little-endian integer, so that bit i of the chunk is bit i % 8 of byte
+ * i / 8, whatever the byte order of the host. The data is allocated in
+ * whole chunks, the bytes past nwords are kept marked in use.
+ *
+ * Searches for a cleared bit skip full chunks using an in-memory summary
+ * that is never saved: bit c of full[] is set when chunk c is all ones,
+ * and bit w of full2[] is set when word w of full[] is all ones. The
+ * summary bits past the last chunk are set. Each word of full2[] covers
+ * 4096 chunks (256K bits), so a search over a nearly full bitmap touches
+ * a few words of the summary rather than every chunk.
+ *
+ * Bit c of dirty[] is set when chunk c has changed since the bitmap was
+ * last cleaned, so that only the changed parts of a bitmap saved on disk
+ * need to be written back.
  */
 
 struct bitmap {
 	u_int32_t nbits;
+	u_int32_t nwords;               /* size of v, may exceed nbits */
+	u_int32_t cursor;               /* next-fit: where allocation resumes */
+	u_int32_t nset;                 /* bits set below nbits */
+	u_int32_t nchunks;              /* 64-bit chunks in v */
+	u_int32_t nfull;                /* words in full */
+	u_int32_t nfull2;               /* words in full2 */
 	WORD_TYPE *v;
+	u_int64_t *full;                /* chunks that are all ones */
+	u_int64_t *full2;               /* words of full that are all ones */
+	u_int64_t *dirty;               /* chunks changed since last cleaned */
 };
 
+#define BITS_PER_CHUNK  64
+#define CHUNK_BYTES     (BITS_PER_CHUNK / BITS_PER_WORD)
+
+static inline u_int64_t bitmap_chunk(const struct bitmap *b, u_int32_t c) {
+	u_int64_t chunk;
+
+	memcpy(&chunk, b->v + (size_t) c * CHUNK_BYTES, sizeof(chunk));
+	return le64toh(chunk);
+}
+
+/* return the first n >= i with bit n set (set != 0) or clear (set == 0)
+ * in the nwords words of s, or nwords * 64 if there is none */
+static u_int32_t summary_find(const u_int64_t *s, u_int32_t nwords,
+		u_int32_t i, int set) {
+	u_int64_t flip = set ? 0 : ~0ULL;
+	u_int32_t w = i / BITS_PER_CHUNK;
+	u_int64_t found;
+
+	if (w >= nwords)
+		return nwords * BITS_PER_CHUNK;
+	found = (s[w] ^ flip) & (~0ULL << (i % BITS_PER_CHUNK));
+	while (!found) {
+		if (++w >= nwords)
+			return nwords * BITS_PER_CHUNK;
+		found = s[w] ^ flip;
+	}
+	return w * BITS_PER_CHUNK + __builtin_ctzll(found);
+}
+
+/* return the first chunk from c on that is not full, or nchunks */
+static u_int32_t bitmap_next_open_chunk(const struct bitmap *b, u_int32_t c) {
+	u_int32_t w = c / BITS_PER_CHUNK;
+	u_int64_t clear;
+
+	if (w >= b->nfull)
+		return b->nchunks;
+	clear = ~b->full[w] & (~0ULL << (c % BITS_PER_CHUNK));
+	while (!clear) {
+		/* the next word of full that has a clear bit */
+		w = summary_find(b->full2, b->nfull2, w + 1, 0);
+		if (w >= b->nfull)
+			return b->nchunks;
+		clear = ~b->full[w];
+	}
+	return w * BITS_PER_CHUNK + __builtin_ctzll(clear);
+}
+
+/* bring the summary bits of chunk c up to date, and mark it dirty, after
+ * it has changed */
+static inline void bitmap_chunk_changed(struct bitmap *b, u_int32_t c) {
+	u_int32_t w = c / BITS_PER_CHUNK;
+	u_int64_t mask = 1ULL << (c % BITS_PER_CHUNK);
+	u_int64_t mask2 = 1ULL << (w % BITS_PER_CHUNK);
+
+	b->dirty[w] |= mask;
+	if (bitmap_chunk(b, c) == ~0ULL) {
+		b->full[w] |= mask;
+		if (b->full[w] == ~0ULL)
+			b->full2[w / BITS_PER_CHUNK] |= mask2;
+	} else {
+		b->full[w] &= ~mask;
+		b->full2[w / BITS_PER_CHUNK] &= ~mask2;
+	}
+}
+
+/* return index of the first bit in [lo, hi) that is set (set != 0) or
+ * clear (set == 0), or hi if there is none */
+static u_int32_t bitmap_find(struct bitmap *b, u_int32_t lo, u_int32_t hi,
+		int set) {
+	u_int64_t flip = set ? 0 : ~0ULL;
+	u_int32_t c = lo / BITS_PER_CHUNK;
+	u_int64_t found;
+
+	if (lo >= hi)
+		return hi;
+	found = (bitmap_chunk(b, c) ^ flip) & (~0ULL << (lo % BITS_PER_CHUNK));
+	for (;;) {
+		if (found) {
+			u_int32_t i = c * BITS_PER_CHUNK + __builtin_ctzll(found);
+			return i < hi ? i : hi;
+		}
+		/* full chunks have no clear bit, skip them */
+		c = set ? c + 1 : bitmap_next_open_chunk(b, c + 1);
+		if (c >= DIVROUNDUP(hi, BITS_PER_CHUNK))
+			return hi;
+		found = bitmap_chunk(b, c) ^ flip;
+	}
+}
+
+static inline u_int32_t bitmap_find_clear(struct bitmap *b, u_int32_t lo,
+		u_int32_t hi) {
+	return bitmap_find(b, lo, hi, 0);
+}
+
 /* return negative value on error */
 // takes nbits as argument, rounds it off to nearest WORD_TYPE = 8 bits.
 // zeroes the trailing bits, initializes bp with the struct bitmap -
 // which contains no of actual bits (minus the trailing bits)
 // and a char array containing all bit information 
 int bitmap_create(u_int32_t nbits, struct bitmap **bp) {
+	return bitmap_create_padded(nbits,
+			DIVROUNDUP(nbits, BITS_PER_WORD) * sizeof(WORD_TYPE), bp);
+}
+
+/* return negative value on error */
+int bitmap_create_padded(u_int32_t nbits, u_int32_t nbytes,
+		struct bitmap **bp) {
 	struct bitmap *b;
-	u_int32_t words;
+	u_int32_t words, nchunks;
 
 	// round up nbits up to 8 BITS_PER_WORD = 8
 	words = DIVROUNDUP(nbits, BITS_PER_WORD);
+	assert(nbytes >= words * sizeof(WORD_TYPE));
+	words = nbytes / sizeof(WORD_TYPE);
 	b = malloc(sizeof(struct bitmap));
 	if (b == NULL) {
 		return -ENOMEM;
 	}
-	b->v = malloc(words * sizeof(WORD_TYPE));
-	if (b->v == NULL) {
+	nchunks = DIVROUNDUP(words * sizeof(WORD_TYPE), CHUNK_BYTES);
+	b->nchunks = nchunks;
+	b->nfull = DIVROUNDUP(nchunks, BITS_PER_CHUNK);
+	b->nfull2 = DIVROUNDUP(b->nfull, BITS_PER_CHUNK);
+	b->v = malloc(ROUNDUP(words * sizeof(WORD_TYPE), CHUNK_BYTES));
+	b->full = malloc(b->nfull * sizeof(u_int64_t));
+	b->full2 = malloc(b->nfull2 * sizeof(u_int64_t));
+	b->dirty = malloc(b->nfull * sizeof(u_int64_t));
+	if (b->v == NULL || b->full == NULL || b->full2 == NULL ||
+			b->dirty == NULL) {
+		free(b->v);
+		free(b->full);
+		free(b->full2);
+		free(b->dirty);
 		free(b);
 		return -ENOMEM;
 	}
 
 	bzero(b->v, words * sizeof(WORD_TYPE));
+	memset(b->v + words, WORD_ALLBITS,
+			ROUNDUP(words * sizeof(WORD_TYPE), CHUNK_BYTES) - words);
 	b->nbits = nbits;
+	b->nwords = words;
+	b->cursor = 0;
+	bitmap_mark_padding(b);
+	bitmap_rebuild_summary(b);
+	*bp = b;
+	return 0;
+}
 
-	/* Mark any leftover bits at the end in use */
-	if (nbits / BITS_PER_WORD < words) {
-		u_int32_t j, ix = words - 1;
-		u_int32_t overbits = nbits - ix * BITS_PER_WORD;
-
-		assert(nbits / BITS_PER_WORD == words-1);
-		assert(overbits > 0 && overbits < BITS_PER_WORD);
+/* Mark any leftover bits at the end in use */
+void bitmap_mark_padding(struct bitmap *b) {
+	u_int32_t ix = b->nbits / BITS_PER_WORD;
+	u_int32_t j, overbits = b->nbits % BITS_PER_WORD;
 
+	if (overbits > 0) {
 		for (j = overbits; j < BITS_PER_WORD; j++) {
 			b->v[ix] |= ((WORD_TYPE) 1 << j);
 		}
+		ix++;
 	}
-	*bp = b;
+	for (; ix < b->nwords; ix++) {
+		b->v[ix] = WORD_ALLBITS;
+	}
+}
+
+/* count the bits set below nbits by scanning the data */
+static u_int32_t bitmap_count(struct bitmap *b) {
+	u_int32_t c, full = b->nbits / BITS_PER_CHUNK;
+	u_int32_t rest = b->nbits % BITS_PER_CHUNK;
+	u_int32_t nr = 0;
+
+	for (c = 0; c < full; c++)
+		nr += __builtin_popcountll(bitmap_chunk(b, c));
+	if (rest)
+		nr += __builtin_popcountll(bitmap_chunk(b, full) &
+				((1ULL << rest) - 1));
+	return nr;
+}
+
+/* recompute the summary and the count of set bits from the data, after
+ * the data has been overwritten. the bitmap is clean afterwards */
+void bitmap_rebuild_summary(struct bitmap *b) {
+	u_int32_t c, w;
+
+	b->nset = bitmap_count(b);
+	bitmap_clean(b);
+
+	bzero(b->full, b->nfull * sizeof(u_int64_t));
+	for (c = 0; c < b->nchunks; c++) {
+		if (bitmap_chunk(b, c) == ~0ULL)
+			b->full[c / BITS_PER_CHUNK] |= 1ULL << (c % BITS_PER_CHUNK);
+	}
+	/* there are no chunks past nchunks, they count as full */
+	if (b->nchunks % BITS_PER_CHUNK)
+		b->full[b->nfull - 1] |= ~0ULL << (b->nchunks % BITS_PER_CHUNK);
+
+	bzero(b->full2, b->nfull2 * sizeof(u_int64_t));
+	for (w = 0; w < b->nfull; w++) {
+		if (b->full[w] == ~0ULL)
+			b->full2[w / BITS_PER_CHUNK] |= 1ULL << (w % BITS_PER_CHUNK);
+	}
+	if (b->nfull % BITS_PER_CHUNK)
+		b->full2[b->nfull2 - 1] |= ~0ULL << (b->nfull % BITS_PER_CHUNK);
+}
+
+/* find the first run of dirty chunks from bit from on, and return it as
+ * the bits lo to hi - 1 (hi is at most nbits).
+ * return negative value when there is none */
+int bitmap_next_dirty(struct bitmap *b, u_int32_t from, u_int32_t *lo,
+		u_int32_t *hi) {
+	u_int32_t c, end;
+
+	if (from >= b->nbits)
+		return -ENOENT;
+	c = summary_find(b->dirty, b->nfull, from / BITS_PER_CHUNK, 1);
+	if ((u_int64_t) c * BITS_PER_CHUNK >= b->nbits)
+		return -ENOENT;
+	end = summary_find(b->dirty, b->nfull, c + 1, 0);
+	*lo = MAX(from, c * BITS_PER_CHUNK);
+	*hi = MIN((u_int64_t) end * BITS_PER_CHUNK, b->nbits);
 	return 0;
 }
 
+/* forget which chunks have changed, after the bitmap has been saved */
+void bitmap_clean(struct bitmap *b) {
+	bzero(b->dirty, b->nfull * sizeof(u_int64_t));
+}
+
 void *
 bitmap_getdata(struct bitmap *b) {
 	return b->v;
 }
 
-/* return negative value on error */
+u_int32_t bitmap_getsize(struct bitmap *b) {
+	return b->nwords * sizeof(WORD_TYPE);
+}
+
+u_int32_t bitmap_get_cursor(struct bitmap *b) {
+	return b->cursor;
+}
+
+/* next-fit: the search starts where the previous allocation ended.
+ * return negative value on error */
 int bitmap_alloc(struct bitmap *b, u_int32_t *index) {
-	u_int32_t ix;
-	u_int32_t maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-	u_int32_t offset;
+	return bitmap_alloc_in(b, 0, b->nbits, index);
+}
 
-	for (ix = 0; ix < maxix; ix++) {
-		if (b->v[ix] != WORD_ALLBITS) {
-			for (offset = 0; offset < BITS_PER_WORD; offset++) {
-				WORD_TYPE mask = ((WORD_TYPE) 1) << offset;
-				if ((b->v[ix] & mask) == 0) {
-					b->v[ix] |= mask;
-					*index = (ix * BITS_PER_WORD) + offset;
-					assert(*index < b->nbits);
-					return 0;
-				}
-			}
-			assert(0);
-		}
-	}
-	return -ENOSPC;
+/* like bitmap_alloc, but only considers bits lo to hi - 1. the search
+ * starts at the cursor if it is in the range.
+ * return negative value on error */
+int bitmap_alloc_in(struct bitmap *b, u_int32_t lo, u_int32_t hi,
+		u_int32_t *index) {
+	u_int32_t from = (b->cursor > lo && b->cursor < hi) ? b->cursor : lo;
+	u_int32_t i;
+
+	assert(hi <= b->nbits);
+	i = bitmap_find_clear(b, from, hi);
+	if (i >= hi && (i = bitmap_find_clear(b, lo, from)) >= from)
+		return -ENOSPC;
+	bitmap_mark(b, i);
+	b->cursor = i + 1;
+	*index = i;
+	return 0;
+}
+
+/* allocate a run of up to want contiguous cleared bits, searching from
+ * hint, or from the cursor if hint is past the end, and wrapping around.
+ * the run is the first one found, so it may be shorter than want. sets
+ * the run and returns it in start and got.
+ * return negative value on error */
+int bitmap_alloc_range(struct bitmap *b, u_int32_t want, u_int32_t hint,
+		u_int32_t *start, u_int32_t *got) {
+	u_int32_t from = hint < b->nbits ? hint : b->cursor;
+	u_int32_t i, end;
+
+	assert(want > 0);
+	if (from >= b->nbits)
+		from = 0;
+	i = bitmap_find_clear(b, from, b->nbits);
+	if (i >= b->nbits && (i = bitmap_find_clear(b, 0, from)) >= from)
+		return -ENOSPC;
+	end = i + MIN(want, b->nbits - i);
+	end = bitmap_find(b, i, end, 1);
+	bitmap_mark_range(b, i, end - i);
+	b->cursor = end;
+	*start = i;
+	*got = end - i;
+	return 0;
+}
+
+/* find the first cleared bit in [lo, hi) without setting it.
+ * return negative value on error */
+int bitmap_find_next_clear(struct bitmap *b, u_int32_t lo, u_int32_t hi,
+		u_int32_t *index) {
+	u_int32_t i;
+
+	assert(hi <= b->nbits);
+	i = bitmap_find_clear(b, lo, hi);
+	if (i >= hi)
+		return -ENOSPC;
+	*index = i;
+	return 0;
+}
+
+/* find the first set bit in [lo, hi) without changing it.
+ * return negative value on error */
+int bitmap_find_next_set(struct bitmap *b, u_int32_t lo, u_int32_t hi,
+		u_int32_t *index) {
+	u_int32_t i;
+
+	assert(hi <= b->nbits);
+	i = bitmap_find(b, lo, hi, 1);
+	if (i >= hi)
+		return -ENOSPC;
+	*index = i;
+	return 0;
 }
 
 static inline void bitmap_translate(u_int32_t bitno, u_int32_t *ix,
@@ -108,6 +383,8 @@ void bitmap_mark(struct bitmap *b, u_int32_t index) {
 	assert((b->v[ix] & mask) == 0);
 
 	b->v[ix] |= mask;
+	b->nset++;
+	bitmap_chunk_changed(b, ix / CHUNK_BYTES);
 }
 
 void bitmap_unmark(struct bitmap *b, u_int32_t index) {
@@ -119,6 +396,50 @@ void bitmap_unmark(struct bitmap *b, u_int32_t index) {
 	assert((b->v[ix] & mask) != 0);
 
 	b->v[ix] &= ~mask;
+	b->nset--;
+	bitmap_chunk_changed(b, ix / CHUNK_BYTES);
+}
+
+/* set (set != 0) or clear the n bits from start on, whole bytes at a
+ * time */
+static void bitmap_fill_range(struct bitmap *b, u_int32_t start, u_int32_t n,
+		int set) {
+	u_int32_t end = start + n;
+	u_int32_t i = start, c;
+
+	assert(end <= b->nbits && end >= start);
+	if (n == 0)
+		return;
+	/* the bits are all clear (set) before */
+	assert(bitmap_find(b, start, end, set) == end);
+	for (; i < end && i % BITS_PER_WORD; i++) {
+		WORD_TYPE mask = (WORD_TYPE) 1 << (i % BITS_PER_WORD);
+		b->v[i / BITS_PER_WORD] ^= mask;
+	}
+	if (end - i >= BITS_PER_WORD) {
+		u_int32_t bytes = (end - i) / BITS_PER_WORD;
+
+		memset(b->v + i / BITS_PER_WORD, set ? WORD_ALLBITS : 0, bytes);
+		i += bytes * BITS_PER_WORD;
+	}
+	for (; i < end; i++) {
+		WORD_TYPE mask = (WORD_TYPE) 1 << (i % BITS_PER_WORD);
+		b->v[i / BITS_PER_WORD] ^= mask;
+	}
+	if (set)
+		b->nset += n;
+	else
+		b->nset -= n;
+	for (c = start / BITS_PER_CHUNK; c <= (end - 1) / BITS_PER_CHUNK; c++)
+		bitmap_chunk_changed(b, c);
+}
+
+void bitmap_mark_range(struct bitmap *b, u_int32_t start, u_int32_t n) {
+	bitmap_fill_range(b, start, n, 1);
+}
+
+void bitmap_unmark_range(struct bitmap *b, u_int32_t start, u_int32_t n) {
+	bitmap_fill_range(b, start, n, 0);
 }
 
 int bitmap_isset(struct bitmap *b, u_int32_t index) {
@@ -130,33 +451,72 @@ int bitmap_isset(struct bitmap *b, u_int32_t index) {
 }
 
 void bitmap_destroy(struct bitmap *b) {
+	free(b->dirty);
+	free(b->full2);
+	free(b->full);
 	free(b->v);
 	free(b);
 }
 
 /* return TRUE when equal, FALSE when not equal */
 int bitmap_equal(struct bitmap *a, struct bitmap *b) {
-	u_int32_t ix;
-	u_int32_t maxix;
-
 	if (a->nbits != b->nbits)
 		return 0;
-	maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
-	for (ix = 0; ix < maxix; ix++) {
-		if (a->v[ix] != b->v[ix])
-			return 0;
+	/* the padding bits of the last byte are set in both */
+	return memcmp(a->v, b->v, DIVROUNDUP(b->nbits, BITS_PER_WORD)) == 0;
+}
+
+/* find the first run of bits from from on that are set in a and clear in
+ * b (*in_a is set), or clear in a and set in b (*in_a is cleared), and
+ * return it as the bits start to end - 1. the bitmaps are compared 64 bits
+ * at a time.
+ * return negative value when the bitmaps do not differ */
+int bitmap_next_diff(struct bitmap *a, struct bitmap *b, u_int32_t from,
+		u_int32_t *start, u_int32_t *end, int *in_a) {
+	u_int32_t nchunks = DIVROUNDUP(a->nbits, BITS_PER_CHUNK);
+	u_int32_t c, i, n;
+	u_int64_t x;
+
+	assert(a->nbits == b->nbits);
+	if (from >= a->nbits)
+		return -ENOENT;
+	c = from / BITS_PER_CHUNK;
+	x = (bitmap_chunk(a, c) ^ bitmap_chunk(b, c)) &
+		(~0ULL << (from % BITS_PER_CHUNK));
+	while (!x) {
+		if (++c >= nchunks)
+			return -ENOENT;
+		x = bitmap_chunk(a, c) ^ bitmap_chunk(b, c);
+	}
+	i = c * BITS_PER_CHUNK + __builtin_ctzll(x);
+	if (i >= a->nbits)
+		return -ENOENT;
+	*in_a = bitmap_isset(a, i) != 0;
+
+	/* the run ends at the first bit that does not differ the same way */
+	for (n = i; n < a->nbits; ) {
+		u_int64_t ca = bitmap_chunk(a, n / BITS_PER_CHUNK);
+		u_int64_t cb = bitmap_chunk(b, n / BITS_PER_CHUNK);
+		u_int64_t d = *in_a ? ca & ~cb : ~ca & cb;
+		u_int64_t stop = ~d & (~0ULL << (n % BITS_PER_CHUNK));
+
+		if (stop) {
+			n += __builtin_ctzll(stop) - n % BITS_PER_CHUNK;
+			break;
+		}
+		n += BITS_PER_CHUNK - n % BITS_PER_CHUNK;
 	}
-	return 1;
+	*start = i;
+	*end = MIN(n, a->nbits);
+	return 0;
 }
 
+/* the count is kept up to date by bitmap_mark and bitmap_unmark */
 int bitmap_nr_allocated(struct bitmap *b) {
-	int i;
-	int nr = 0;
+	return b->nset;
+}
 
-	for (i = 0; i < b->nbits; i++) {
-		if (bitmap_isset(b, i))
-			nr++;
-	}
-	return nr;
+int bitmap_nr_free(struct bitmap *b) {
+	return b->nbits - b->nset;
 }
 
@@ -7,12 +7,42 @@
  * Functions:
  *     bitmap_create  - allocate a new bitmap object.
  *                      Returns NULL on error.
+ *     bitmap_create_padded - allocate a bitmap of nbits bits whose data
+ *                      occupies nbytes bytes (e.g., whole disk blocks).
+ *                      All bits past nbits are marked in use.
+ *     bitmap_mark_padding - mark the bits past nbits in use again, after
+ *                      the data has been overwritten (e.g., read from
+ *                      disk).
+ *     bitmap_rebuild_summary - recompute the in-memory summary of full
+ *                      regions that speeds up searches, and the count
+ *                      of set bits, after the data has been overwritten.
+ *     bitmap_next_dirty - locate the next run of bits changed since the
+ *                      bitmap was last cleaned (at 64 bit granularity).
+ *     bitmap_clean   - mark the whole bitmap unchanged, e.g., after it
+ *                      has been written to disk.
  *     bitmap_getdata - return pointer to raw bit data (for I/O).
+ *     bitmap_getsize - return size of the raw bit data in bytes.
  *     bitmap_alloc   - locate a cleared bit, set it, and return its index.
+ *                      The search is next-fit: it resumes after the bit
+ *                      allocated last (the cursor).
+ *     bitmap_alloc_in - same, for a cleared bit in a range of indexes.
+ *     bitmap_alloc_range - locate a run of contiguous cleared bits, up to
+ *                      a given length, starting the search at a hint.
+ *     bitmap_get_cursor - return where the next search resumes.
+ *     bitmap_find_next_clear - locate a cleared bit in a range of indexes,
+ *                      without setting it.
+ *     bitmap_find_next_set - locate a set bit in a range of indexes.
  *     bitmap_mark    - set a clear bit by its index.
  *     bitmap_unmark  - clear a set bit by its index.
+ *     bitmap_mark_range - set a run of clear bits.
+ *     bitmap_unmark_range - clear a run of set bits.
  *     bitmap_isset   - return whether a particular bit is set or not.
  *     bitmap_destroy - destroy bitmap.
+ *     bitmap_equal   - return whether two bitmaps have the same bits set.
+ *     bitmap_next_diff - locate the next run of bits that are set in one of
+ *                      two bitmaps and clear in the other.
+ *     bitmap_nr_allocated - return the number of set bits.
+ *     bitmap_nr_free - return the number of cleared bits.
  */
 
 #include <sys/types.h>
@@ -25,14 +55,40 @@
 struct bitmap;  /* Opaque. */
 
 int            bitmap_create(u_int32_t nbits, struct bitmap **bp);
+int            bitmap_create_padded(u_int32_t nbits, u_int32_t nbytes,
+                                    struct bitmap **bp);
+void           bitmap_mark_padding(struct bitmap *);
+void           bitmap_rebuild_summary(struct bitmap *);
+int            bitmap_next_dirty(struct bitmap *, u_int32_t from,
+                                 u_int32_t *lo, u_int32_t *hi);
+void           bitmap_clean(struct bitmap *);
 void          *bitmap_getdata(struct bitmap *);
+u_int32_t      bitmap_getsize(struct bitmap *);
 int            bitmap_alloc(struct bitmap *, u_int32_t *index);
+int            bitmap_alloc_in(struct bitmap *, u_int32_t lo, u_int32_t hi,
+                               u_int32_t *index);
+int            bitmap_alloc_range(struct bitmap *, u_int32_t want,
+                                  u_int32_t hint, u_int32_t *start,
+                                  u_int32_t *got);
+u_int32_t      bitmap_get_cursor(struct bitmap *);
+int            bitmap_find_next_clear(struct bitmap *, u_int32_t lo,
+                                      u_int32_t hi, u_int32_t *index);
+int            bitmap_find_next_set(struct bitmap *, u_int32_t lo,
+                                    u_int32_t hi, u_int32_t *index);
 void           bitmap_mark(struct bitmap *, u_int32_t index);
 void           bitmap_unmark(struct bitmap *, u_int32_t index);
+void           bitmap_mark_range(struct bitmap *, u_int32_t start,
+                                 u_int32_t n);
+void           bitmap_unmark_range(struct bitmap *, u_int32_t start,
+                                   u_int32_t n);
 int	       bitmap_isset(struct bitmap *, u_int32_t index);
 void           bitmap_destroy(struct bitmap *);
 int            bitmap_equal(struct bitmap *, struct bitmap *);
+int            bitmap_next_diff(struct bitmap *a, struct bitmap *b,
+                                u_int32_t from, u_int32_t *start,
+                                u_int32_t *end, int *in_a);
 int            bitmap_nr_allocated(struct bitmap *);
+int            bitmap_nr_free(struct bitmap *);
 
 #endif /* _BITMAP_H_ */
 
@@ -1,5 +1,8 @@
 #include "testfs.h"
 #include "block.h"
+#include "dev.h"
+#include "bcache.h"
+#include "iostat.h"
 #include <assert.h>
 
 //#define KLEE
@@ -8,35 +11,116 @@
 #include <klee/klee.h>
 #endif
 
-static char zero[BLOCK_SIZE] = { 0 };
+/*
+ * memory-mapped devices have no buffer cache (sb->bcache is NULL): their
+ * transfers are copies to and from the mapping, so blocks go to the
+ * device directly.
+ */
+
+static void dev_check(int ret, const char *what) {
+	if (ret < 0) {
+		errno = -ret;
+		EXIT(what);
+	}
+}
+
+static void dev_read(struct super_block *sb, char *blocks, int start,
+		int nr) {
+	dev_check(sb->dev->ops->read(sb->dev, blocks,
+			(off_t) start * BLOCK_SIZE(sb), (size_t) nr * BLOCK_SIZE(sb)),
+			"read");
+}
+
+static void dev_write(struct super_block *sb, char *blocks, int start,
+		int nr) {
+	dev_check(sb->dev->ops->write(sb->dev, blocks,
+			(off_t) start * BLOCK_SIZE(sb), (size_t) nr * BLOCK_SIZE(sb)),
+			"write");
+}
+
+static void dev_read_vec(struct super_block *sb, struct block_vec *vec,
+		int cnt) {
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		dev_read(sb, vec[i].bv_data, vec[i].bv_nr, 1);
+}
+
+static void dev_write_vec(struct super_block *sb, struct block_vec *vec,
+		int cnt) {
+	int i;
+
+	for (i = 0; i < cnt; i++)
+		dev_write(sb, vec[i].bv_data, vec[i].bv_nr, 1);
+}
 
 /*
  * write buffer blocks to disk.
+ * blocks go into the buffer cache of the super block, and reach the
+ * device when the cache is flushed at transaction commit or unmount.
  */
 
 void write_blocks(struct super_block *sb, char *blocks, int start, int nr) {
-	long pos;
+	unsigned long long t0 = iostat_now();
 
-	if ((pos = ftell(sb->dev)) < 0) {
-		EXIT("ftell");
-	}
-	if (fseek(sb->dev, start * BLOCK_SIZE, SEEK_SET) < 0) {
-		EXIT("fseek");
-	}
-	if (fwrite(blocks, BLOCK_SIZE, nr, sb->dev) != nr) {
-		EXIT("fwrite");
-	}
-	if (fseek(sb->dev, pos, SEEK_SET) < 0) {
-		EXIT("fseek");
+	if (!sb->bcache) {
+		dev_write(sb, blocks, start, nr);
+	} else {
+		bcache_write(sb->bcache, blocks, start, nr);
 	}
+	iostat_account(sb, IOSTAT_WRITE, start, nr, t0);
 }
 
 void zero_blocks(struct super_block *sb, int start, int nr) {
-	int i;
-
-	for (i = 0; i < nr; i++) {
-		write_blocks(sb, zero, start + i, 1);
+	unsigned long long t0 = iostat_now();
+
+	if (!sb->bcache) {
+		dev_check(sb->dev->ops->zero(sb->dev,
+				(off_t) start * BLOCK_SIZE(sb),
+				(size_t) nr * BLOCK_SIZE(sb)), "write");
+	} else {
+		bcache_write(sb->bcache, NULL, start, nr);
 	}
+	iostat_account(sb, IOSTAT_WRITE, start, nr, t0);
+}
+
+/*
+ * scatter/gather write: vec[i].bv_data is written to block vec[i].bv_nr.
+ * the blocks need not be adjacent, adjacent ones reach the device in a
+ * single request.
+ */
+void write_blocks_vec(struct super_block *sb, struct block_vec *vec, int cnt) {
+	unsigned long long t0 = iostat_now();
+
+	if (!sb->bcache)
+		dev_write_vec(sb, vec, cnt);
+	else
+		bcache_writev(sb->bcache, vec, cnt);
+	iostat_account_vec(sb, IOSTAT_WRITE, vec, cnt, t0);
+}
+
+/*
+ * read ahead: load blocks vec[i].bv_nr into the buffer cache in one batch,
+ * without copying them anywhere (bv_data is ignored). nothing to do for
+ * uncached (memory-mapped) devices.
+ */
+void prefetch_blocks(struct super_block *sb, struct block_vec *vec, int cnt) {
+	unsigned long long t0 = iostat_now();
+
+	if (!sb->bcache || cnt == 0)
+		return;
+	bcache_prefetch(sb->bcache, vec, cnt);
+	iostat_account_vec(sb, IOSTAT_READ, vec, cnt, t0);
+}
+
+/* write back cached blocks and push them to stable storage */
+void flush_blocks(struct super_block *sb) {
+	unsigned long long t0 = iostat_now();
+
+	if (sb->bcache)
+		bcache_flush(sb->bcache);
+	dev_check(sb->dev->ops->flush(sb->dev), "flush");
+	iostat_account_flush(sb, t0);
 }
 
 #ifdef KLEE
@@ -60,25 +144,19 @@ void klee_make_symbolic_range(void* addr, size_t offset, size_t nbytes, const ch
 
 /*
  read 'nr' number of blocks from start offset, place them in blocks.
- reset the sb->dev block pointer to the original position.
- you need sb only for the device handle name, stored in sb->dev
+ cached blocks are copied from the buffer cache, the others are read
+ from the device handle stored in sb->dev
  */
 
 void read_blocks(struct super_block *sb, char *blocks, int start, int nr) {
-	long pos;
+	unsigned long long t0 = iostat_now();
 
-	if ((pos = ftell(sb->dev)) < 0) {
-		EXIT("ftell");
-	}
-	if (fseek(sb->dev, start * BLOCK_SIZE, SEEK_SET) < 0) {
-		EXIT("fseek");
-	}
-	if (fread(blocks, BLOCK_SIZE, nr, sb->dev) != nr) {
-		EXIT("freed");
-	}
-	if (fseek(sb->dev, pos, SEEK_SET) < 0) {
-		EXIT("fseek");
+	if (sb->bcache) {
+		bcache_read(sb->bcache, blocks, start, nr);
+	} else {
+		dev_read(sb, blocks, start, nr);
 	}
+	iostat_account(sb, IOSTAT_READ, start, nr, t0);
 
 #ifdef KLEE
 	int blockNumber[NUM_SYMBOLS] = {64};
@@ -98,3 +176,34 @@ void read_blocks(struct super_block *sb, char *blocks, int start, int nr) {
 	}
 #endif
 }
+
+/*
+ scatter/gather read: block vec[i].bv_nr is read into vec[i].bv_data.
+ blocks that miss the cache are sorted and adjacent ones are read from
+ the device with a single request.
+ */
+
+void read_blocks_vec(struct super_block *sb, struct block_vec *vec, int cnt) {
+	unsigned long long t0 = iostat_now();
+
+	if (sb->bcache)
+		bcache_readv(sb->bcache, vec, cnt);
+	else
+		dev_read_vec(sb, vec, cnt);
+	iostat_account_vec(sb, IOSTAT_READ, vec, cnt, t0);
+
+#ifdef KLEE
+	int blockNumber[NUM_SYMBOLS] = {64};
+	int offset[NUM_SYMBOLS] = { 12};
+
+	int i,j;
+
+	for(i = 0 ; i < NUM_SYMBOLS ; i++){
+		for(j = 0 ; j < cnt ; j++){
+			if(blockNumber[i] == vec[j].bv_nr){
+				klee_make_symbolic_range(vec[j].bv_data, offset[i], sizeof(vec[j].bv_data),"offset");
+			}
+		}
+	}
+#endif
+}
@@ -1,10 +1,15 @@
 #ifndef _BLOCK_H
 #define _BLOCK_H
 #include "super.h"
+#include "ioq.h"
 
 void write_blocks(struct super_block *sb, char *blocks, int start, int nr);
 void zero_blocks(struct super_block *sb, int start, int nr);
 void read_blocks(struct super_block *sb, char *blocks, int start, int nr);
+void read_blocks_vec(struct super_block *sb, struct block_vec *vec, int cnt);
+void write_blocks_vec(struct super_block *sb, struct block_vec *vec, int cnt);
+void prefetch_blocks(struct super_block *sb, struct block_vec *vec, int cnt);
+void flush_blocks(struct super_block *sb);
 
 #endif /* _BLOCK_H */
 
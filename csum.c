@@ -1,6 +1,7 @@
 #include "csum.h"
 #include "super.h"
 #include "block.h"
+#include "group.h"
 #include <assert.h>
 
 /* returns 0 on error */
@@ -10,7 +11,7 @@ testfs_get_csum(struct super_block *sb, int block_nr)
         assert(sb);
         assert(sb->csum_table);
         
-        if ( block_nr < MAX_NR_CSUMS ) {
+        if ( block_nr < MAX_NR_CSUMS(sb) ) {
                 return sb->csum_table[block_nr];
         }
         
@@ -20,22 +21,18 @@ testfs_get_csum(struct super_block *sb, int block_nr)
 static void
 testfs_write_csum(struct super_block *sb, int block_nr)
 {
-        int nr = block_nr * sizeof(int) / BLOCK_SIZE;
-        char * table = (char *)sb->csum_table;
-        
-        assert(table);
-        write_blocks(sb, table + (nr * BLOCK_SIZE), 
-                     sb->sb.csum_table_start + nr, 1);
+        assert(sb->csum_table);
+        testfs_write_table(sb, TESTFS_CSUM_TABLE, block_nr);
 }
 
 void
 testfs_put_csum(struct super_block *sb, int phy_block_nr, int csum)
 {
-        int block_nr = phy_block_nr - sb->sb.data_blocks_start;
+        int block_nr = testfs_data_block_index(sb, phy_block_nr);
         assert(sb);
         assert(sb->csum_table);
         
-        assert(block_nr >= 0 && block_nr < MAX_NR_CSUMS);
+        assert(block_nr >= 0 && block_nr < MAX_NR_CSUMS(sb));
         sb->csum_table[block_nr] = csum;
         testfs_write_csum(sb, block_nr);
 }
@@ -61,11 +58,11 @@ testfs_calculate_csum(const char * buf, const int size)
 int
 testfs_verify_csum(struct super_block *sb, int phy_block_nr)
 {
-        char block[BLOCK_SIZE];
+        char block[BLOCK_SIZE(sb)];
         int csum;
-        int block_nr = phy_block_nr - sb->sb.data_blocks_start;
+        int block_nr = testfs_data_block_index(sb, phy_block_nr);
         
-        assert(block_nr >= 0 && block_nr < MAX_NR_CSUMS);
+        assert(block_nr >= 0 && block_nr < MAX_NR_CSUMS(sb));
         read_blocks(sb, block, phy_block_nr, 1);
         csum = testfs_calculate_csum(block, sizeof(block));
         
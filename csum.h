@@ -3,7 +3,8 @@
 
 #include "testfs.h"
 
-#define MAX_NR_CSUMS (CSUM_TABLE_SIZE * BLOCK_SIZE / sizeof(int))
+/* one checksum per data block, see testfs_data_block_index */
+#define MAX_NR_CSUMS(sb) ((sb)->geo.nr_data_blocks)
 
 struct super_block;
 
@@ -0,0 +1,41 @@
+/*
+ * Block device reference counting and batch submission.
+ * See dev.h for more information.
+ */
+
+#include <assert.h>
+#include "dev.h"
+
+void testfs_dev_get(struct block_dev *dev) {
+	assert(dev->refs > 0);
+	dev->refs++;
+}
+
+/* drops a reference, releasing the backend with the last one */
+void testfs_dev_put(struct block_dev *dev) {
+	assert(dev->refs > 0);
+	if (--dev->refs == 0) {
+		dev->ops->release(dev);
+	}
+}
+
+/* issue a batch of requests, through the backend's submit op when it has
+ * one. returns the first error, or 0 */
+int testfs_dev_submit(struct block_dev *dev, struct dev_req *reqs, int nr) {
+	int i, ret;
+
+	if (dev->ops->submit)
+		return dev->ops->submit(dev, reqs, nr);
+	for (i = 0; i < nr; i++) {
+		if (reqs[i].write) {
+			ret = dev->ops->writev(dev, reqs[i].iov, reqs[i].iovcnt,
+					reqs[i].pos);
+		} else {
+			ret = dev->ops->readv(dev, reqs[i].iov, reqs[i].iovcnt,
+					reqs[i].pos);
+		}
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
@@ -0,0 +1,85 @@
+#ifndef _DEV_H
+#define _DEV_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Block device backends.
+ *
+ * The file system never talks to the storage directly. Each mounted
+ * super block holds a struct block_dev whose ops table implements byte
+ * addressed transfers on the underlying image. All operations return 0 on
+ * success or a negative errno value.
+ *
+ * Ops:
+ *     read    - read len bytes at pos into buf.
+ *     write   - write len bytes from buf at pos.
+ *     readv   - read into the iovcnt buffers of iov, starting at pos.
+ *     writev  - write the iovcnt buffers of iov, starting at pos.
+ *     zero    - write len zero bytes at pos.
+ *     submit  - optional. issue a batch of independent vectored requests
+ *               and wait for all of them. backends that can overlap
+ *               requests (io_uring) implement it, testfs_dev_submit
+ *               falls back to one readv/writev per request otherwise.
+ *     flush   - push written data to stable storage. called at every
+ *               transaction commit and at unmount.
+ *     release - free the backend once the last reference is dropped.
+ *
+ * Devices are reference counted. testfs_make_super_block and
+ * testfs_init_super_block take over the caller's reference and drop it
+ * when the super block is closed. Take an extra reference with
+ * testfs_dev_get to keep a device (e.g., a RAM disk) across mounts.
+ */
+
+/* flags for testfs_dev_open_file */
+#define BDEV_CREATE     0x1     /* create or truncate the image */
+#define BDEV_URING      0x2     /* submit batches through io_uring */
+#define BDEV_BARRIER    0x4     /* no O_SYNC, fdatasync on flush instead */
+
+/* capabilities of an open device */
+#define BDEV_CAP_MAPPED 0x1     /* transfers are memory copies, no cache */
+
+struct block_dev;
+
+/* one vectored transfer of a batch */
+struct dev_req {
+        int write;
+        const struct iovec *iov;
+        int iovcnt;
+        off_t pos;
+        ssize_t res;            /* set by submit: bytes done or -errno */
+};
+
+struct block_dev_ops {
+        int (*read)(struct block_dev *dev, char *buf, off_t pos, size_t len);
+        int (*write)(struct block_dev *dev, const char *buf, off_t pos,
+                     size_t len);
+        int (*readv)(struct block_dev *dev, const struct iovec *iov,
+                     int iovcnt, off_t pos);
+        int (*writev)(struct block_dev *dev, const struct iovec *iov,
+                      int iovcnt, off_t pos);
+        int (*zero)(struct block_dev *dev, off_t pos, size_t len);
+        int (*submit)(struct block_dev *dev, struct dev_req *reqs, int nr);
+        int (*flush)(struct block_dev *dev);
+        void (*release)(struct block_dev *dev);
+};
+
+struct block_dev {
+        const struct block_dev_ops *ops;
+        int caps;               /* BDEV_CAP_* */
+        int refs;
+        void *priv;             /* backend private data */
+};
+
+int testfs_dev_open_file(const char *file, int flags, struct block_dev **devp);
+int testfs_dev_open_direct(const char *file, int flags,
+                           struct block_dev **devp);
+int testfs_dev_open_mmap(const char *file, int flags, struct block_dev **devp);
+int testfs_dev_create_ram(size_t size, struct block_dev **devp);
+
+void testfs_dev_get(struct block_dev *dev);
+void testfs_dev_put(struct block_dev *dev);
+int testfs_dev_submit(struct block_dev *dev, struct dev_req *reqs, int nr);
+
+#endif /* _DEV_H */
@@ -0,0 +1,300 @@
+/*
+ * Direct I/O backend: the image is opened O_DIRECT, so transfers bypass
+ * the kernel page cache and the buffer cache of the super block is the
+ * only copy of the image in memory.
+ *
+ * O_DIRECT transfers must be aligned in memory, offset and length, so
+ * every request is staged through a bounce buffer from a small pool of
+ * aligned buffers. Runs of adjacent 64 byte testfs blocks (a vectored
+ * request from the ioq) are packed into one aligned transfer. Writes that
+ * do not cover whole sectors read the partial head and tail sectors
+ * first (read-modify-write). Durability comes from an fdatasync at flush,
+ * as with BDEV_BARRIER.
+ */
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <assert.h>
+#include "common.h"
+#include "dev.h"
+
+/* alignment of O_DIRECT transfers. 4096 is a multiple of the logical
+ * sector size of any device. */
+#define DIRECT_ALIGN     4096
+/* size of a bounce buffer, i.e., of the largest single transfer */
+#define DIRECT_BUF_SIZE  (64 * 1024)
+/* nr of idle bounce buffers kept around */
+#define DIRECT_POOL_SIZE 4
+
+#define ALIGN_DOWN(a)   ((a) / DIRECT_ALIGN * DIRECT_ALIGN)
+
+struct direct_dev {
+	int fd;
+	int dirty;                      /* written since the last flush */
+	int nr_free;
+	char *pool[DIRECT_POOL_SIZE];   /* idle bounce buffers */
+};
+
+/* position in the caller's buffers. a NULL iov is an endless source of
+ * zeroes. */
+struct iov_iter {
+	const struct iovec *iov;
+	int iovcnt;
+	size_t off;                     /* into iov[0] */
+};
+
+static char *direct_buf_get(struct direct_dev *ddev) {
+	void *buf;
+
+	if (ddev->nr_free > 0)
+		return ddev->pool[--ddev->nr_free];
+	if (posix_memalign(&buf, DIRECT_ALIGN, DIRECT_BUF_SIZE) != 0)
+		return NULL;
+	return buf;
+}
+
+static void direct_buf_put(struct direct_dev *ddev, char *buf) {
+	if (ddev->nr_free < DIRECT_POOL_SIZE)
+		ddev->pool[ddev->nr_free++] = buf;
+	else
+		free(buf);
+}
+
+/* copy len bytes between buf and the iterator, in the direction given by
+ * to_iov */
+static void iov_iter_copy(struct iov_iter *it, char *buf, size_t len,
+		int to_iov) {
+	while (len > 0) {
+		size_t n;
+
+		if (!it->iov) {
+			assert(!to_iov);
+			bzero(buf, len);
+			return;
+		}
+		assert(it->iovcnt > 0);
+		n = MIN(len, it->iov->iov_len - it->off);
+		if (to_iov)
+			memcpy((char *) it->iov->iov_base + it->off, buf, n);
+		else
+			memcpy(buf, (char *) it->iov->iov_base + it->off, n);
+		buf += n;
+		len -= n;
+		it->off += n;
+		if (it->off == it->iov->iov_len) {
+			it->iov++;
+			it->iovcnt--;
+			it->off = 0;
+		}
+	}
+}
+
+/* aligned read. returns the nr of bytes read, short at the end of the
+ * image, or a negative value on error */
+static ssize_t direct_pread(int fd, char *buf, size_t len, off_t pos) {
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pread(fd, buf + done, len - done, pos + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static int direct_pwrite(int fd, const char *buf, size_t len, off_t pos) {
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = pwrite(fd, buf + done, len - done, pos + done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		done += ret;
+	}
+	return 0;
+}
+
+/* read the aligned sector at pos into buf. past the end of the image it
+ * reads as zeroes. */
+static int direct_read_sector(int fd, char *buf, off_t pos) {
+	ssize_t ret = direct_pread(fd, buf, DIRECT_ALIGN, pos);
+
+	if (ret < 0)
+		return ret;
+	bzero(buf + ret, DIRECT_ALIGN - ret);
+	return 0;
+}
+
+/* transfer len bytes at pos, to or from it, one bounce buffer at a time */
+static int direct_rw(struct block_dev *dev, struct iov_iter *it, off_t pos,
+		size_t len, int write) {
+	struct direct_dev *ddev = dev->priv;
+	char *bounce;
+	int ret = 0;
+
+	if ((bounce = direct_buf_get(ddev)) == NULL)
+		return -ENOMEM;
+	if (write)
+		ddev->dirty = 1;
+	while (len > 0) {
+		off_t lo = ALIGN_DOWN(pos);
+		size_t skip = pos - lo;
+		size_t n = MIN(len, DIRECT_BUF_SIZE - skip);
+		size_t span = ROUNDUP(skip + n, DIRECT_ALIGN);
+		ssize_t got;
+
+		if (!write) {
+			if ((got = direct_pread(ddev->fd, bounce, span, lo)) < 0) {
+				ret = got;
+				break;
+			}
+			if ((size_t) got < skip + n) { /* short image */
+				ret = -EIO;
+				break;
+			}
+			iov_iter_copy(it, bounce + skip, n, 1);
+		} else {
+			/* partial head and tail sectors */
+			if (skip > 0 && (ret = direct_read_sector(ddev->fd, bounce,
+					lo)) < 0)
+				break;
+			if ((skip + n) % DIRECT_ALIGN && (span > DIRECT_ALIGN ||
+					skip == 0) && (ret = direct_read_sector(ddev->fd,
+					bounce + span - DIRECT_ALIGN,
+					lo + span - DIRECT_ALIGN)) < 0)
+				break;
+			iov_iter_copy(it, bounce + skip, n, 0);
+			if ((ret = direct_pwrite(ddev->fd, bounce, span, lo)) < 0)
+				break;
+		}
+		pos += n;
+		len -= n;
+	}
+	direct_buf_put(ddev, bounce);
+	return ret;
+}
+
+static size_t iov_total(const struct iovec *iov, int iovcnt) {
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+static int direct_dev_read(struct block_dev *dev, char *buf, off_t pos,
+		size_t len) {
+	struct iovec iov = { buf, len };
+	struct iov_iter it = { &iov, 1, 0 };
+
+	return direct_rw(dev, &it, pos, len, 0);
+}
+
+static int direct_dev_write(struct block_dev *dev, const char *buf,
+		off_t pos, size_t len) {
+	struct iovec iov = { (void *) buf, len };
+	struct iov_iter it = { &iov, 1, 0 };
+
+	return direct_rw(dev, &it, pos, len, 1);
+}
+
+static int direct_dev_readv(struct block_dev *dev, const struct iovec *iov,
+		int iovcnt, off_t pos) {
+	struct iov_iter it = { iov, iovcnt, 0 };
+
+	return direct_rw(dev, &it, pos, iov_total(iov, iovcnt), 0);
+}
+
+static int direct_dev_writev(struct block_dev *dev, const struct iovec *iov,
+		int iovcnt, off_t pos) {
+	struct iov_iter it = { iov, iovcnt, 0 };
+
+	return direct_rw(dev, &it, pos, iov_total(iov, iovcnt), 1);
+}
+
+static int direct_dev_zero(struct block_dev *dev, off_t pos, size_t len) {
+	struct iov_iter it = { NULL, 0, 0 };
+
+	return direct_rw(dev, &it, pos, len, 1);
+}
+
+static int direct_dev_flush(struct block_dev *dev) {
+	struct direct_dev *ddev = dev->priv;
+
+	if (!ddev->dirty)
+		return 0;
+	if (fdatasync(ddev->fd) < 0)
+		return -errno;
+	ddev->dirty = 0;
+	return 0;
+}
+
+static void direct_dev_release(struct block_dev *dev) {
+	struct direct_dev *ddev = dev->priv;
+
+	while (ddev->nr_free > 0)
+		free(ddev->pool[--ddev->nr_free]);
+	close(ddev->fd);
+	free(ddev);
+	free(dev);
+}
+
+static const struct block_dev_ops direct_dev_ops = {
+	.read = direct_dev_read,
+	.write = direct_dev_write,
+	.readv = direct_dev_readv,
+	.writev = direct_dev_writev,
+	.zero = direct_dev_zero,
+	.flush = direct_dev_flush,
+	.release = direct_dev_release,
+};
+
+/* open the image with O_DIRECT. flags are as for testfs_dev_open_file,
+ * except that BDEV_URING and BDEV_BARRIER are meaningless here.
+ * returns negative value on error, -EINVAL if the file system of the
+ * image does not support direct I/O */
+int testfs_dev_open_direct(const char *file, int flags,
+		struct block_dev **devp) {
+	struct block_dev *dev;
+	struct direct_dev *ddev;
+	int oflags = O_RDWR | O_DIRECT;
+
+	if (flags & BDEV_CREATE) {
+		oflags |= O_CREAT | O_TRUNC;
+	}
+	dev = malloc(sizeof(struct block_dev));
+	ddev = calloc(1, sizeof(struct direct_dev));
+	if (!dev || !ddev) {
+		free(dev);
+		free(ddev);
+		return -ENOMEM;
+	}
+	if ((ddev->fd = open(file, oflags, 0666)) < 0) {
+		int ret = -errno;
+		free(dev);
+		free(ddev);
+		return ret;
+	}
+	dev->ops = &direct_dev_ops;
+	dev->caps = 0;
+	dev->refs = 1;
+	dev->priv = ddev;
+	*devp = dev;
+	return 0;
+}
@@ -0,0 +1,281 @@
+/*
+ * File backend: the image is a regular file or a raw device accessed
+ * with pread/pwrite on its descriptor. Opened with BDEV_URING, batches of
+ * requests are submitted together through io_uring and reaped together,
+ * instead of one synchronous system call after the other.
+ *
+ * By default the descriptor is O_SYNC and every write is stable when it
+ * returns. Opened with BDEV_BARRIER, writes are left to the page cache and
+ * the flush op issues a single fdatasync barrier for everything written
+ * since the previous flush.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <assert.h>
+#include "common.h"
+#include "dev.h"
+#include "uring.h"
+
+#define ZERO_CHUNK 4096
+#define ZERO_IOV   64
+
+struct file_dev {
+	int fd;
+	struct uring *ring;             /* NULL unless opened with BDEV_URING */
+	int barrier;                    /* opened with BDEV_BARRIER */
+	int dirty;                      /* written since the last flush */
+};
+
+static inline int file_dev_fd(struct block_dev *dev) {
+	return ((struct file_dev *) dev->priv)->fd;
+}
+
+static inline void file_dev_dirty(struct block_dev *dev) {
+	((struct file_dev *) dev->priv)->dirty = 1;
+}
+
+static int file_dev_read(struct block_dev *dev, char *buf, off_t pos,
+		size_t len) {
+	ssize_t ret;
+
+	while (len > 0) {
+		if ((ret = pread(file_dev_fd(dev), buf, len, pos)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (ret == 0) /* short image */
+			return -EIO;
+		buf += ret;
+		pos += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int file_dev_write(struct block_dev *dev, const char *buf, off_t pos,
+		size_t len) {
+	ssize_t ret;
+
+	file_dev_dirty(dev);
+	while (len > 0) {
+		if ((ret = pwrite(file_dev_fd(dev), buf, len, pos)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		buf += ret;
+		pos += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int file_dev_rw_vec(struct block_dev *dev, const struct iovec *iov,
+		int iovcnt, off_t pos, int write);
+
+/* continue a vectored transfer at pos of which done bytes have already
+ * been transferred */
+static int file_dev_rw_rest(struct block_dev *dev, const struct iovec *iov,
+		int iovcnt, off_t pos, int write, size_t done) {
+	/* skip the buffers that were transferred completely */
+	while (iovcnt > 0 && done >= iov->iov_len) {
+		done -= iov->iov_len;
+		pos += iov->iov_len;
+		iov++;
+		iovcnt--;
+	}
+	if (iovcnt > 0 && done > 0) {
+		/* finish the partially transferred buffer */
+		char *buf = (char *) iov->iov_base + done;
+		size_t len = iov->iov_len - done;
+		int ret;
+
+		if (write) {
+			ret = file_dev_write(dev, buf, pos + done, len);
+		} else {
+			ret = file_dev_read(dev, buf, pos + done, len);
+		}
+		if (ret < 0)
+			return ret;
+		pos += iov->iov_len;
+		iov++;
+		iovcnt--;
+	}
+	if (iovcnt == 0)
+		return 0;
+	return file_dev_rw_vec(dev, iov, iovcnt, pos, write);
+}
+
+/* one preadv/pwritev per call unless the kernel transfers less than
+ * asked, in which case the remainder is resubmitted */
+static int file_dev_rw_vec(struct block_dev *dev, const struct iovec *iov,
+		int iovcnt, off_t pos, int write) {
+	ssize_t ret;
+
+	if (write)
+		file_dev_dirty(dev);
+	do {
+		if (write) {
+			ret = pwritev(file_dev_fd(dev), iov, iovcnt, pos);
+		} else {
+			ret = preadv(file_dev_fd(dev), iov, iovcnt, pos);
+		}
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0)
+		return -errno;
+	if (ret == 0) /* short image */
+		return -EIO;
+	return file_dev_rw_rest(dev, iov, iovcnt, pos, write, ret);
+}
+
+static int file_dev_readv(struct block_dev *dev, const struct iovec *iov,
+		int iovcnt, off_t pos) {
+	return file_dev_rw_vec(dev, iov, iovcnt, pos, 0);
+}
+
+static int file_dev_writev(struct block_dev *dev, const struct iovec *iov,
+		int iovcnt, off_t pos) {
+	return file_dev_rw_vec(dev, iov, iovcnt, pos, 1);
+}
+
+/* every vector points at the same zero chunk */
+static int file_dev_zero(struct block_dev *dev, off_t pos, size_t len) {
+	static const char zero[ZERO_CHUNK] = { 0 };
+	struct iovec iov[ZERO_IOV];
+	int iovcnt, ret;
+
+	while (len > 0) {
+		size_t n = 0;
+
+		for (iovcnt = 0; iovcnt < ZERO_IOV && len > 0; iovcnt++) {
+			iov[iovcnt].iov_base = (void *) zero;
+			iov[iovcnt].iov_len = len < ZERO_CHUNK ? len : ZERO_CHUNK;
+			len -= iov[iovcnt].iov_len;
+			n += iov[iovcnt].iov_len;
+		}
+		if ((ret = file_dev_rw_vec(dev, iov, iovcnt, pos, 1)) < 0)
+			return ret;
+		pos += n;
+	}
+	return 0;
+}
+
+/* overlap all requests of the batch through io_uring. requests that the
+ * kernel completed only partially are finished synchronously. */
+static int file_dev_submit(struct block_dev *dev, struct dev_req *reqs,
+		int nr) {
+	struct file_dev *fdev = dev->priv;
+	int i, ret;
+
+	for (i = 0; i < nr; i++) {
+		if (reqs[i].write)
+			fdev->dirty = 1;
+	}
+	if ((ret = uring_submit(fdev->ring, reqs, nr)) < 0)
+		return ret;
+	for (i = 0; i < nr; i++) {
+		if (reqs[i].res < 0)
+			return reqs[i].res;
+		ret = file_dev_rw_rest(dev, reqs[i].iov, reqs[i].iovcnt,
+				reqs[i].pos, reqs[i].write, reqs[i].res);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
+}
+
+/* O_SYNC descriptors are already stable after each write. otherwise this
+ * is the barrier, skipped when nothing was written since the last one. */
+static int file_dev_flush(struct block_dev *dev) {
+	struct file_dev *fdev = dev->priv;
+
+	if (!fdev->barrier || !fdev->dirty)
+		return 0;
+	if (fdatasync(fdev->fd) < 0)
+		return -errno;
+	fdev->dirty = 0;
+	return 0;
+}
+
+static void file_dev_release(struct block_dev *dev) {
+	struct file_dev *fdev = dev->priv;
+
+	if (fdev->ring)
+		uring_destroy(fdev->ring);
+	close(fdev->fd);
+	free(dev->priv);
+	free(dev);
+}
+
+static const struct block_dev_ops file_dev_ops = {
+	.read = file_dev_read,
+	.write = file_dev_write,
+	.readv = file_dev_readv,
+	.writev = file_dev_writev,
+	.zero = file_dev_zero,
+	.flush = file_dev_flush,
+	.release = file_dev_release,
+};
+
+static const struct block_dev_ops file_dev_uring_ops = {
+	.read = file_dev_read,
+	.write = file_dev_write,
+	.readv = file_dev_readv,
+	.writev = file_dev_writev,
+	.zero = file_dev_zero,
+	.submit = file_dev_submit,
+	.flush = file_dev_flush,
+	.release = file_dev_release,
+};
+
+/* returns negative value on error */
+int testfs_dev_open_file(const char *file, int flags, struct block_dev **devp) {
+	struct block_dev *dev;
+	struct file_dev *fdev;
+	int oflags = O_RDWR;
+
+	if (flags & BDEV_CREATE) {
+		oflags |= O_CREAT | O_TRUNC;
+	}
+#ifndef DISABLE_OSYNC
+	else if (!(flags & BDEV_BARRIER)) {
+		oflags |= O_SYNC;
+	}
+#endif
+	dev = malloc(sizeof(struct block_dev));
+	fdev = malloc(sizeof(struct file_dev));
+	if (!dev || !fdev) {
+		free(dev);
+		free(fdev);
+		return -ENOMEM;
+	}
+	if ((fdev->fd = open(file, oflags, 0666)) < 0) {
+		int ret = -errno;
+		free(dev);
+		free(fdev);
+		return ret;
+	}
+	fdev->ring = NULL;
+	fdev->barrier = (flags & BDEV_BARRIER) != 0;
+	fdev->dirty = 0;
+	if (flags & BDEV_URING) {
+		int ret = uring_create(fdev->fd, URING_DEPTH, &fdev->ring);
+		if (ret < 0) {
+			close(fdev->fd);
+			free(dev);
+			free(fdev);
+			return ret;
+		}
+	}
+	dev->ops = fdev->ring ? &file_dev_uring_ops : &file_dev_ops;
+	dev->caps = 0;
+	dev->refs = 1;
+	dev->priv = fdev;
+	*devp = dev;
+	return 0;
+}
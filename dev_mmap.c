@@ -0,0 +1,205 @@
+/*
+ * Memory-mapped backend: the whole image is mapped into the address space
+ * with MAP_SHARED, so block transfers are plain memory copies and never
+ * enter the kernel. Durability comes from msync, issued by the flush op at
+ * transaction commit and unmount for the range written since the last
+ * flush. Like a sparse file, the image (and its mapping) grows on writes
+ * past its end.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include "common.h"
+#include "dev.h"
+
+struct mmap_dev {
+	int fd;
+	char *base;                     /* NULL while the image is empty */
+	size_t size;
+	size_t dirty_lo;                /* written range since last flush */
+	size_t dirty_hi;
+};
+
+static size_t mmap_dev_page_size(void) {
+	return (size_t) sysconf(_SC_PAGESIZE);
+}
+
+/* extend the image and the mapping so that size bytes are mapped */
+static int mmap_dev_grow(struct mmap_dev *mdev, size_t size) {
+	char *base;
+
+	if (size <= mdev->size)
+		return 0;
+	size = ROUNDUP(size, mmap_dev_page_size());
+	if (ftruncate(mdev->fd, size) < 0)
+		return -errno;
+	base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mdev->fd, 0);
+	if (base == MAP_FAILED)
+		return -errno;
+	if (mdev->base)
+		munmap(mdev->base, mdev->size);
+	mdev->base = base;
+	mdev->size = size;
+	return 0;
+}
+
+static void mmap_dev_dirty(struct mmap_dev *mdev, off_t pos, size_t len) {
+	if (mdev->dirty_lo >= mdev->dirty_hi) {
+		mdev->dirty_lo = pos;
+		mdev->dirty_hi = pos + len;
+	} else {
+		mdev->dirty_lo = MIN(mdev->dirty_lo, (size_t) pos);
+		mdev->dirty_hi = MAX(mdev->dirty_hi, pos + len);
+	}
+}
+
+static int mmap_dev_read(struct block_dev *dev, char *buf, off_t pos,
+		size_t len) {
+	struct mmap_dev *mdev = dev->priv;
+
+	if (pos + len > mdev->size) /* short image */
+		return -EIO;
+	memcpy(buf, mdev->base + pos, len);
+	return 0;
+}
+
+static int mmap_dev_write(struct block_dev *dev, const char *buf, off_t pos,
+		size_t len) {
+	struct mmap_dev *mdev = dev->priv;
+	int ret;
+
+	if ((ret = mmap_dev_grow(mdev, pos + len)) < 0)
+		return ret;
+	memcpy(mdev->base + pos, buf, len);
+	mmap_dev_dirty(mdev, pos, len);
+	return 0;
+}
+
+static int mmap_dev_readv(struct block_dev *dev, const struct iovec *iov,
+		int iovcnt, off_t pos) {
+	int i, ret;
+
+	for (i = 0; i < iovcnt; i++) {
+		if ((ret = mmap_dev_read(dev, iov[i].iov_base, pos,
+				iov[i].iov_len)) < 0)
+			return ret;
+		pos += iov[i].iov_len;
+	}
+	return 0;
+}
+
+static int mmap_dev_writev(struct block_dev *dev, const struct iovec *iov,
+		int iovcnt, off_t pos) {
+	int i, ret;
+
+	for (i = 0; i < iovcnt; i++) {
+		if ((ret = mmap_dev_write(dev, iov[i].iov_base, pos,
+				iov[i].iov_len)) < 0)
+			return ret;
+		pos += iov[i].iov_len;
+	}
+	return 0;
+}
+
+static int mmap_dev_zero(struct block_dev *dev, off_t pos, size_t len) {
+	struct mmap_dev *mdev = dev->priv;
+	int ret;
+
+	if ((ret = mmap_dev_grow(mdev, pos + len)) < 0)
+		return ret;
+	bzero(mdev->base + pos, len);
+	mmap_dev_dirty(mdev, pos, len);
+	return 0;
+}
+
+/* msync the pages written since the last flush */
+static int mmap_dev_flush(struct block_dev *dev) {
+	struct mmap_dev *mdev = dev->priv;
+	size_t lo, hi;
+
+	if (mdev->dirty_lo >= mdev->dirty_hi)
+		return 0;
+	lo = mdev->dirty_lo / mmap_dev_page_size() * mmap_dev_page_size();
+	hi = mdev->dirty_hi;
+	if (msync(mdev->base + lo, hi - lo, MS_SYNC) < 0)
+		return -errno;
+	mdev->dirty_lo = mdev->dirty_hi = 0;
+	return 0;
+}
+
+static void mmap_dev_release(struct block_dev *dev) {
+	struct mmap_dev *mdev = dev->priv;
+
+	if (mdev->base)
+		munmap(mdev->base, mdev->size);
+	close(mdev->fd);
+	free(mdev);
+	free(dev);
+}
+
+static const struct block_dev_ops mmap_dev_ops = {
+	.read = mmap_dev_read,
+	.write = mmap_dev_write,
+	.readv = mmap_dev_readv,
+	.writev = mmap_dev_writev,
+	.zero = mmap_dev_zero,
+	.flush = mmap_dev_flush,
+	.release = mmap_dev_release,
+};
+
+/* map the image file. flags are as for testfs_dev_open_file, except that
+ * BDEV_URING and BDEV_BARRIER are meaningless here: flush is always an
+ * msync barrier.
+ * returns negative value on error */
+int testfs_dev_open_mmap(const char *file, int flags, struct block_dev **devp) {
+	struct block_dev *dev;
+	struct mmap_dev *mdev;
+	struct stat st;
+	int oflags = O_RDWR;
+	int ret;
+
+	if (flags & BDEV_CREATE) {
+		oflags |= O_CREAT | O_TRUNC;
+	}
+	dev = malloc(sizeof(struct block_dev));
+	mdev = calloc(1, sizeof(struct mmap_dev));
+	if (!dev || !mdev) {
+		free(dev);
+		free(mdev);
+		return -ENOMEM;
+	}
+	if ((mdev->fd = open(file, oflags, 0666)) < 0) {
+		ret = -errno;
+		goto fail;
+	}
+	if (fstat(mdev->fd, &st) < 0) {
+		ret = -errno;
+		goto fail_close;
+	}
+	if (st.st_size > 0) {
+		mdev->base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED, mdev->fd, 0);
+		if (mdev->base == MAP_FAILED) {
+			ret = -errno;
+			goto fail_close;
+		}
+		mdev->size = st.st_size;
+	}
+	dev->ops = &mmap_dev_ops;
+	dev->caps = BDEV_CAP_MAPPED;
+	dev->refs = 1;
+	dev->priv = mdev;
+	*devp = dev;
+	return 0;
+
+fail_close:
+	close(mdev->fd);
+fail:
+	free(dev);
+	free(mdev);
+	return ret;
+}
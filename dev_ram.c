@@ -0,0 +1,132 @@
+/*
+ * RAM disk backend: the image lives in a heap buffer, so no I/O ever
+ * reaches the kernel. Like a sparse file, the image grows on writes past
+ * its end; reading past the end is an error.
+ */
+
+#include <assert.h>
+#include "common.h"
+#include "dev.h"
+
+struct ram_dev {
+	char *data;
+	size_t size;
+};
+
+static int ram_dev_grow(struct ram_dev *rdev, size_t size) {
+	char *data;
+
+	if (size <= rdev->size)
+		return 0;
+	if ((data = realloc(rdev->data, size)) == NULL)
+		return -ENOMEM;
+	bzero(data + rdev->size, size - rdev->size);
+	rdev->data = data;
+	rdev->size = size;
+	return 0;
+}
+
+static int ram_dev_read(struct block_dev *dev, char *buf, off_t pos,
+		size_t len) {
+	struct ram_dev *rdev = dev->priv;
+
+	if (pos + len > rdev->size)
+		return -EIO;
+	memcpy(buf, rdev->data + pos, len);
+	return 0;
+}
+
+static int ram_dev_write(struct block_dev *dev, const char *buf, off_t pos,
+		size_t len) {
+	struct ram_dev *rdev = dev->priv;
+	int ret;
+
+	if ((ret = ram_dev_grow(rdev, pos + len)) < 0)
+		return ret;
+	memcpy(rdev->data + pos, buf, len);
+	return 0;
+}
+
+static int ram_dev_readv(struct block_dev *dev, const struct iovec *iov,
+		int iovcnt, off_t pos) {
+	int i, ret;
+
+	for (i = 0; i < iovcnt; i++) {
+		if ((ret = ram_dev_read(dev, iov[i].iov_base, pos,
+				iov[i].iov_len)) < 0)
+			return ret;
+		pos += iov[i].iov_len;
+	}
+	return 0;
+}
+
+static int ram_dev_writev(struct block_dev *dev, const struct iovec *iov,
+		int iovcnt, off_t pos) {
+	int i, ret;
+
+	for (i = 0; i < iovcnt; i++) {
+		if ((ret = ram_dev_write(dev, iov[i].iov_base, pos,
+				iov[i].iov_len)) < 0)
+			return ret;
+		pos += iov[i].iov_len;
+	}
+	return 0;
+}
+
+static int ram_dev_zero(struct block_dev *dev, off_t pos, size_t len) {
+	struct ram_dev *rdev = dev->priv;
+	int ret;
+
+	if ((ret = ram_dev_grow(rdev, pos + len)) < 0)
+		return ret;
+	bzero(rdev->data + pos, len);
+	return 0;
+}
+
+static int ram_dev_flush(struct block_dev *dev) {
+	return 0;
+}
+
+static void ram_dev_release(struct block_dev *dev) {
+	struct ram_dev *rdev = dev->priv;
+
+	free(rdev->data);
+	free(rdev);
+	free(dev);
+}
+
+static const struct block_dev_ops ram_dev_ops = {
+	.read = ram_dev_read,
+	.write = ram_dev_write,
+	.readv = ram_dev_readv,
+	.writev = ram_dev_writev,
+	.zero = ram_dev_zero,
+	.flush = ram_dev_flush,
+	.release = ram_dev_release,
+};
+
+/* create a zero filled RAM disk of size bytes.
+ * returns negative value on error */
+int testfs_dev_create_ram(size_t size, struct block_dev **devp) {
+	struct block_dev *dev;
+	struct ram_dev *rdev;
+
+	dev = malloc(sizeof(struct block_dev));
+	rdev = calloc(1, sizeof(struct ram_dev));
+	if (!dev || !rdev) {
+		free(dev);
+		free(rdev);
+		return -ENOMEM;
+	}
+	if (ram_dev_grow(rdev, size) < 0) {
+		free(dev);
+		free(rdev);
+		return -ENOMEM;
+	}
+	dev->ops = &ram_dev_ops;
+	dev->caps = 0;
+	dev->refs = 1;
+	dev->priv = rdev;
+	*devp = dev;
+	return 0;
+}
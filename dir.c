@@ -23,20 +23,22 @@ int namelen;
 struct dirent *
 testfs_next_dirent(struct inode *dir, int *offset) 
 {
+	int bsize;
 	int ret;
 	struct dirent d;
 	struct dirent *dp;
 
 	assert(dir);
 	assert(testfs_inode_get_type(dir) == I_DIR);
+	bsize = BLOCK_SIZE(testfs_inode_get_sb(dir));
 
 	// check size of the directory with offset
 	if (*offset >= testfs_inode_get_size(dir))
 		return NULL;
 
 	/* Make sure a struct dirent entry does not span multiple blocks. */
-	if((((*offset) + sizeof(struct dirent)) / BLOCK_SIZE) > ((*offset) / BLOCK_SIZE))
-		(*offset) = (((*offset) + sizeof(struct dirent)) / BLOCK_SIZE) * BLOCK_SIZE;
+	if((((*offset) + sizeof(struct dirent)) / bsize) > ((*offset) / bsize))
+		(*offset) = (((*offset) + sizeof(struct dirent)) / bsize) * bsize;
 
 	// read data from dir into buffer "d" at offset-offset of size struct dirent
 	// dirent contains inode number and name length value
@@ -47,7 +49,7 @@ testfs_next_dirent(struct inode *dir, int *offset)
 	// assert(d.d_name_len > 0);
 	if(d.d_name_len == 0) {
 		/* The next entry is located inside the next block allocated for this directory. */
-		(*offset) = (((*offset) / BLOCK_SIZE) + 1) * BLOCK_SIZE;
+		(*offset) = (((*offset) / bsize) + 1) * bsize;
 
 		ret = testfs_read_data(dir, *offset, (char *) &d, sizeof(struct dirent));
 		if (ret < 0)
@@ -109,6 +111,7 @@ testfs_find_dirent(struct inode *dir, int inode_nr)
 static int testfs_write_dirent(struct inode *dir, char *name, int len,
 		int inode_nr, int offset) 
 {
+	int bsize = BLOCK_SIZE(testfs_inode_get_sb(dir));
 	int ret;
 	int total_bytes = sizeof(struct dirent) + len;
 	struct dirent *d = malloc(total_bytes);
@@ -123,8 +126,8 @@ static int testfs_write_dirent(struct inode *dir, char *name, int len,
 	/* Make sure a struct dirent entry does not span multiple blocks. In case the new dirent
 	 * does not fit inside the current block, we fill the current block with zeroes and update
 	 * the offset to point at the next available offset. */
-	if(((offset + total_bytes) / BLOCK_SIZE) > (offset / BLOCK_SIZE)) {
-		int next_offset = ((offset + total_bytes) / BLOCK_SIZE) * BLOCK_SIZE;
+	if(((offset + total_bytes) / bsize) > (offset / bsize)) {
+		int next_offset = ((offset + total_bytes) / bsize) * bsize;
 		int total = next_offset - offset;
 		char *buf = malloc(total);
 
@@ -365,7 +368,7 @@ static int testfs_create_file_or_dir(struct super_block *sb, struct context *c,
 	/* Make sure that the specified name does not exceed the size of one block. */
 	if(name_to_create != NULL)				// KLEE - TODO -generate name such that both
 								// name_to_create != and == NULL are tested
-		if(namelen + 1 > BLOCK_SIZE - sizeof(struct dirent))	// KLEE GENERATE different namelens
+		if(namelen + 1 > BLOCK_SIZE(sb) - sizeof(struct dirent))	// KLEE GENERATE different namelens
 			return -EINVAL;
 
 	testfs_tx_start(sb, TX_CREATE);
@@ -384,7 +387,7 @@ static int testfs_create_file_or_dir(struct super_block *sb, struct context *c,
 	 * allocates new inode (using calloc). assigns in to
 	 * newly created inode
 	 */
-	ret = testfs_create_inode(sb, type, &in);
+	ret = testfs_create_inode(sb, type, c ? c->cur_dir : NULL, &in);
 	if (ret < 0) {
 		goto fail;
 	}
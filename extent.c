@@ -0,0 +1,420 @@
+/*
+ * Tree of free extents.
+ * See extent.h for more information.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <assert.h>
+#include "extent.h"
+#include "testfs.h"
+
+/*
+ * Both trees are AVL trees. An extent is linked into both of them, the
+ * links are embedded in the extent.
+ */
+
+struct avl_link {
+	struct avl_link *left;
+	struct avl_link *right;
+	int height;
+};
+
+struct free_extent {
+	u_int32_t start;
+	u_int32_t len;
+	struct avl_link by_start;       /* ordered by start */
+	struct avl_link by_len;         /* ordered by len, then start */
+};
+
+struct extent_tree {
+	struct avl_link *by_start;
+	struct avl_link *by_len;
+	u_int32_t nr_extents;
+};
+
+#define EXTENT_OF(l, field) ((struct free_extent *) \
+		((char *) (l) - offsetof(struct free_extent, field)))
+
+typedef int (*avl_cmp)(const struct avl_link *, const struct avl_link *);
+
+static int cmp_start(const struct avl_link *a, const struct avl_link *b) {
+	u_int32_t x = EXTENT_OF(a, by_start)->start;
+	u_int32_t y = EXTENT_OF(b, by_start)->start;
+
+	return x < y ? -1 : x > y;
+}
+
+static int cmp_len(const struct avl_link *a, const struct avl_link *b) {
+	const struct free_extent *x = EXTENT_OF(a, by_len);
+	const struct free_extent *y = EXTENT_OF(b, by_len);
+
+	if (x->len != y->len)
+		return x->len < y->len ? -1 : 1;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static inline int avl_height(const struct avl_link *l) {
+	return l ? l->height : 0;
+}
+
+static inline void avl_fix_height(struct avl_link *l) {
+	l->height = 1 + MAX(avl_height(l->left), avl_height(l->right));
+}
+
+static struct avl_link *avl_rotate_right(struct avl_link *y) {
+	struct avl_link *x = y->left;
+
+	y->left = x->right;
+	x->right = y;
+	avl_fix_height(y);
+	avl_fix_height(x);
+	return x;
+}
+
+static struct avl_link *avl_rotate_left(struct avl_link *x) {
+	struct avl_link *y = x->right;
+
+	x->right = y->left;
+	y->left = x;
+	avl_fix_height(x);
+	avl_fix_height(y);
+	return y;
+}
+
+/* restore the balance of l, whose subtrees differ in height by 2 at most.
+ * returns the new root of the subtree */
+static struct avl_link *avl_balance(struct avl_link *l) {
+	int balance;
+
+	avl_fix_height(l);
+	balance = avl_height(l->left) - avl_height(l->right);
+	if (balance > 1) {
+		if (avl_height(l->left->left) < avl_height(l->left->right))
+			l->left = avl_rotate_left(l->left);
+		return avl_rotate_right(l);
+	}
+	if (balance < -1) {
+		if (avl_height(l->right->right) < avl_height(l->right->left))
+			l->right = avl_rotate_right(l->right);
+		return avl_rotate_left(l);
+	}
+	return l;
+}
+
+static struct avl_link *avl_insert(struct avl_link *root, struct avl_link *l,
+		avl_cmp cmp) {
+	if (!root) {
+		l->left = l->right = NULL;
+		l->height = 1;
+		return l;
+	}
+	if (cmp(l, root) < 0)
+		root->left = avl_insert(root->left, l, cmp);
+	else
+		root->right = avl_insert(root->right, l, cmp);
+	return avl_balance(root);
+}
+
+/* unlink the leftmost link of root, returned in *min */
+static struct avl_link *avl_remove_min(struct avl_link *root,
+		struct avl_link **min) {
+	if (!root->left) {
+		*min = root;
+		return root->right;
+	}
+	root->left = avl_remove_min(root->left, min);
+	return avl_balance(root);
+}
+
+static struct avl_link *avl_remove(struct avl_link *root, struct avl_link *l,
+		avl_cmp cmp) {
+	struct avl_link *min, *right;
+	int c;
+
+	assert(root);
+	c = cmp(l, root);
+	if (c < 0) {
+		root->left = avl_remove(root->left, l, cmp);
+	} else if (c > 0) {
+		root->right = avl_remove(root->right, l, cmp);
+	} else {
+		assert(root == l);
+		if (!l->right)
+			return l->left;
+		right = avl_remove_min(l->right, &min);
+		min->left = l->left;
+		min->right = right;
+		return avl_balance(min);
+	}
+	return avl_balance(root);
+}
+
+static void extent_link(struct extent_tree *t, struct free_extent *e) {
+	assert(e->len > 0);
+	t->by_start = avl_insert(t->by_start, &e->by_start, cmp_start);
+	t->by_len = avl_insert(t->by_len, &e->by_len, cmp_len);
+	t->nr_extents++;
+}
+
+static void extent_unlink(struct extent_tree *t, struct free_extent *e) {
+	t->by_start = avl_remove(t->by_start, &e->by_start, cmp_start);
+	t->by_len = avl_remove(t->by_len, &e->by_len, cmp_len);
+	t->nr_extents--;
+}
+
+/* the extent with the largest start <= index, or NULL */
+static struct free_extent *extent_floor(struct extent_tree *t,
+		u_int32_t index) {
+	struct avl_link *l = t->by_start;
+	struct free_extent *found = NULL;
+
+	while (l) {
+		struct free_extent *e = EXTENT_OF(l, by_start);
+
+		if (e->start <= index) {
+			found = e;
+			l = l->right;
+		} else {
+			l = l->left;
+		}
+	}
+	return found;
+}
+
+/* the extent with the smallest start >= index, or NULL */
+static struct free_extent *extent_ceil(struct extent_tree *t,
+		u_int32_t index) {
+	struct avl_link *l = t->by_start;
+	struct free_extent *found = NULL;
+
+	while (l) {
+		struct free_extent *e = EXTENT_OF(l, by_start);
+
+		if (e->start >= index) {
+			found = e;
+			l = l->left;
+		} else {
+			l = l->right;
+		}
+	}
+	return found;
+}
+
+/* the first extent at or after (len, start) in length order, or NULL */
+static struct free_extent *extent_fit(struct extent_tree *t, u_int32_t len,
+		u_int32_t start) {
+	struct avl_link *l = t->by_len;
+	struct free_extent *found = NULL;
+
+	while (l) {
+		struct free_extent *e = EXTENT_OF(l, by_len);
+
+		if (e->len > len || (e->len == len && e->start >= start)) {
+			found = e;
+			l = l->left;
+		} else {
+			l = l->right;
+		}
+	}
+	return found;
+}
+
+static struct free_extent *extent_longest(struct extent_tree *t) {
+	struct avl_link *l = t->by_len;
+
+	if (!l)
+		return NULL;
+	while (l->right)
+		l = l->right;
+	return EXTENT_OF(l, by_len);
+}
+
+/* return negative value on error */
+int extent_tree_create(struct extent_tree **tp) {
+	struct extent_tree *t = malloc(sizeof(struct extent_tree));
+
+	if (t == NULL) {
+		return -ENOMEM;
+	}
+	t->by_start = NULL;
+	t->by_len = NULL;
+	t->nr_extents = 0;
+	*tp = t;
+	return 0;
+}
+
+static void extent_free_all(struct avl_link *l) {
+	if (!l)
+		return;
+	extent_free_all(l->left);
+	extent_free_all(l->right);
+	free(EXTENT_OF(l, by_start));
+}
+
+void extent_tree_destroy(struct extent_tree *t) {
+	extent_free_all(t->by_start);
+	free(t);
+}
+
+/* return negative value on error */
+int extent_tree_insert(struct extent_tree *t, u_int32_t start,
+		u_int32_t len) {
+	struct free_extent *prev, *next, *e;
+
+	assert(len > 0);
+	prev = extent_floor(t, start);
+	next = extent_ceil(t, start);
+	/* the run is not free already */
+	assert(!prev || prev->start + prev->len <= start);
+	assert(!next || start + len <= next->start);
+	if (prev && prev->start + prev->len == start) {
+		extent_unlink(t, prev);
+		prev->len += len;
+		e = prev;
+	} else {
+		e = malloc(sizeof(struct free_extent));
+		if (e == NULL) {
+			return -ENOMEM;
+		}
+		e->start = start;
+		e->len = len;
+	}
+	if (next && next->start == start + len) {
+		extent_unlink(t, next);
+		e->len += next->len;
+		free(next);
+	}
+	extent_link(t, e);
+	return 0;
+}
+
+/* the extent holding the best run of up to want indexes within [lo, hi),
+ * in the subtree l of by_start: the shortest part within the range that
+ * is at least want long, or the longest part if none is. *best_len is the
+ * length of that part, 0 if no extent overlaps the range */
+static void extent_range_fit(struct avl_link *l, u_int32_t lo, u_int32_t hi,
+		u_int32_t want, struct free_extent **best,
+		u_int32_t *best_len) {
+	struct free_extent *e;
+	u_int32_t len;
+	int fits, best_fits;
+
+	if (!l)
+		return;
+	e = EXTENT_OF(l, by_start);
+	/* the extents of the left subtree end before e starts, the ones of
+	 * the right subtree start after it */
+	if (e->start > lo)
+		extent_range_fit(l->left, lo, hi, want, best, best_len);
+	if (e->start < hi && e->start + e->len > lo) {
+		len = MIN(e->start + e->len, hi) - MAX(e->start, lo);
+		fits = len >= want;
+		best_fits = *best_len >= want;
+		if (*best_len == 0 ||
+				(fits && (!best_fits || len < *best_len)) ||
+				(!fits && !best_fits && len > *best_len)) {
+			*best = e;
+			*best_len = len;
+		}
+	}
+	if (e->start < hi)
+		extent_range_fit(l->right, lo, hi, want, best, best_len);
+}
+
+/* remove the run of n indexes from s on, within extent e.
+ * return negative value on error */
+static int extent_take(struct extent_tree *t, struct free_extent *e,
+		u_int32_t s, u_int32_t n) {
+	struct free_extent *f;
+	u_int32_t end = e->start + e->len;
+
+	assert(s >= e->start && s + n <= end);
+	/* what is left of e before and after the run */
+	if (s > e->start && s + n < end) {
+		f = malloc(sizeof(struct free_extent));
+		if (f == NULL) {
+			return -ENOMEM;
+		}
+		extent_unlink(t, e);
+		e->len = s - e->start;
+		extent_link(t, e);
+		f->start = s + n;
+		f->len = end - f->start;
+		extent_link(t, f);
+	} else {
+		extent_unlink(t, e);
+		if (s > e->start) {
+			e->len = s - e->start;
+			extent_link(t, e);
+		} else if (s + n < end) {
+			e->start = s + n;
+			e->len = end - e->start;
+			extent_link(t, e);
+		} else {
+			free(e);
+		}
+	}
+	return 0;
+}
+
+/* remove a run of up to want indexes, starting at hint if it is free.
+ * otherwise the run is the best fit within [lo, hi): it comes from the
+ * shortest free part of the range of at least want indexes, or from the
+ * longest one if none is long enough. only if the range is all in use,
+ * the run is taken from the shortest extent of at least want indexes,
+ * the first one from lo on if there are several, or from the longest
+ * extent if none is long enough. the run does not cross a multiple of
+ * boundary, unless boundary is 0.
+ * return negative value on error */
+int extent_tree_alloc(struct extent_tree *t, u_int32_t want, u_int32_t hint,
+		u_int32_t lo, u_int32_t hi, u_int32_t boundary,
+		u_int32_t *start, u_int32_t *got) {
+	struct free_extent *e = NULL, *f;
+	u_int32_t s = 0, n, end, len = 0;
+	int ret;
+
+	assert(want > 0);
+	if (hint != EXTENT_NO_HINT) {
+		e = extent_floor(t, hint);
+		if (e && hint - e->start < e->len)
+			s = hint;
+		else
+			e = NULL;
+	}
+	if (!e && lo < hi) {
+		extent_range_fit(t->by_start, lo, hi, want, &e, &len);
+		if (e)
+			s = MAX(e->start, lo);
+	}
+	if (!e) {
+		e = extent_fit(t, want, 0);
+		if (e) {
+			f = extent_fit(t, e->len, lo);
+			if (f && f->len == e->len)
+				e = f;
+		} else {
+			e = extent_longest(t);
+		}
+		if (!e)
+			return -ENOSPC;
+		s = e->start;
+	}
+	end = e->start + e->len;
+	if (len > 0)
+		end = MIN(end, hi);
+	n = MIN(want, end - s);
+	if (boundary)
+		n = MIN(n, (s / boundary + 1) * boundary - s);
+	ret = extent_take(t, e, s, n);
+	if (ret < 0)
+		return ret;
+	*start = s;
+	*got = n;
+	return 0;
+}
+
+u_int32_t extent_tree_nr_extents(struct extent_tree *t) {
+	return t->nr_extents;
+}
@@ -0,0 +1,48 @@
+#ifndef _EXTENT_H
+#define _EXTENT_H
+
+#include <sys/types.h>
+
+/*
+ * Tree of free extents. (Used by the extent block allocator.)
+ *
+ * The free data blocks are kept as maximal runs (start, length) of data
+ * block indexes, in two balanced trees over the same extents: one ordered
+ * by start, to find the extent holding an index and to merge an extent
+ * with its neighbours when it is freed, and one ordered by length, to
+ * find the smallest extent that is long enough. Each operation costs
+ * O(log n) in the number of extents, whatever the extent lengths.
+ *
+ * The tree is not saved: it is built from the block freemap at mount time
+ * and kept in step with it.
+ *
+ * Functions:
+ *     extent_tree_create  - allocate an empty tree.
+ *     extent_tree_destroy - free a tree and its extents.
+ *     extent_tree_insert  - add a free run of indexes, merging it with the
+ *                           extents next to it.
+ *     extent_tree_alloc   - remove a run of up to a given length. The run
+ *                           starts at a hint if the hint is free, otherwise
+ *                           it is the best fit within a range of indexes,
+ *                           and only if the range is all in use, the best
+ *                           fit anywhere: the smallest extent that is long
+ *                           enough, or the longest one.
+ *     extent_tree_nr_extents - return the number of extents.
+ */
+
+struct extent_tree;     /* Opaque. */
+
+/* hint of extent_tree_alloc when there is none */
+#define EXTENT_NO_HINT  ((u_int32_t) -1)
+
+int             extent_tree_create(struct extent_tree **tp);
+void            extent_tree_destroy(struct extent_tree *);
+int             extent_tree_insert(struct extent_tree *, u_int32_t start,
+                                   u_int32_t len);
+int             extent_tree_alloc(struct extent_tree *, u_int32_t want,
+                                  u_int32_t hint, u_int32_t lo, u_int32_t hi,
+                                  u_int32_t boundary, u_int32_t *start,
+                                  u_int32_t *got);
+u_int32_t       extent_tree_nr_extents(struct extent_tree *);
+
+#endif /* _EXTENT_H */
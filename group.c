@@ -0,0 +1,413 @@
+/*
+ * Block groups.
+ * See group.h for more information.
+ */
+
+#include <assert.h>
+#include "testfs.h"
+#include "super.h"
+#include "group.h"
+#include "inode.h"
+#include "block.h"
+#include "bitmap.h"
+#include "extent.h"
+
+/* the part of an in-memory table kept by one group */
+struct table_slice {
+	char *data;
+	size_t len;             /* bytes of data, the region may be larger */
+	int start;              /* first block of the region */
+	int size;               /* blocks in the region */
+	int fill;               /* byte that pads the region after len */
+};
+
+/* nr of data blocks in group g, the last group may be short */
+static int testfs_group_nr_data_blocks(struct super_block *sb, int g) {
+	return MIN(sb->geo.blocks_per_group,
+			sb->geo.nr_data_blocks - g * sb->geo.blocks_per_group);
+}
+
+static int testfs_alloc_groups(struct super_block *sb) {
+	size_t size = MAX((size_t) sb->geo.group_desc_size * BLOCK_SIZE(sb),
+			sb->geo.nr_groups * sizeof(struct dgroup_desc));
+
+	sb->groups = calloc(1, size);
+	if (!sb->groups)
+		return -ENOMEM;
+	return 0;
+}
+
+/* lay out the groups of sb one after the other, following the super
+ * block and the group descriptors. returns negative value on error */
+int testfs_make_groups(struct super_block *sb) {
+	struct testfs_geometry *geo = &sb->geo;
+	int start = SUPER_BLOCK_SIZE + geo->group_desc_size;
+	int g, ret;
+
+	ret = testfs_alloc_groups(sb);
+	if (ret < 0)
+		return ret;
+	for (g = 0; g < geo->nr_groups; g++) {
+		struct dgroup_desc *gd = &sb->groups[g];
+
+		gd->inode_freemap_start = start;
+		gd->block_freemap_start = gd->inode_freemap_start +
+			geo->inode_freemap_size;
+		gd->csum_table_start = gd->block_freemap_start +
+			geo->block_freemap_size;
+		gd->inode_blocks_start = gd->csum_table_start +
+			geo->csum_table_size;
+		gd->data_blocks_start = gd->inode_blocks_start +
+			geo->nr_inode_blocks;
+		start = gd->data_blocks_start + testfs_group_nr_data_blocks(sb, g);
+	}
+	if (geo->group_desc_size > 0)
+		write_blocks(sb, (char *) sb->groups, SUPER_BLOCK_SIZE,
+				geo->group_desc_size);
+	return 0;
+}
+
+/* read the group descriptors of sb, or take the single group of an
+ * ungrouped image from the dsuper_block, and check that the groups follow
+ * one another. returns negative value on error */
+int testfs_read_groups(struct super_block *sb) {
+	struct testfs_geometry *geo = &sb->geo;
+	int start = SUPER_BLOCK_SIZE + geo->group_desc_size;
+	int g, ret;
+
+	ret = testfs_alloc_groups(sb);
+	if (ret < 0)
+		return ret;
+	if (geo->group_desc_size > 0) {
+		read_blocks(sb, (char *) sb->groups, SUPER_BLOCK_SIZE,
+				geo->group_desc_size);
+	} else {
+		sb->groups[0].inode_freemap_start = sb->sb.inode_freemap_start;
+		sb->groups[0].block_freemap_start = sb->sb.block_freemap_start;
+		sb->groups[0].csum_table_start = sb->sb.csum_table_start;
+		sb->groups[0].inode_blocks_start = sb->sb.inode_blocks_start;
+		sb->groups[0].data_blocks_start = sb->sb.data_blocks_start;
+	}
+	for (g = 0; g < geo->nr_groups; g++) {
+		struct dgroup_desc *gd = &sb->groups[g];
+
+		if (gd->inode_freemap_start < start ||
+				gd->block_freemap_start != gd->inode_freemap_start +
+				geo->inode_freemap_size ||
+				gd->csum_table_start != gd->block_freemap_start +
+				geo->block_freemap_size ||
+				gd->inode_blocks_start != gd->csum_table_start +
+				geo->csum_table_size ||
+				gd->data_blocks_start != gd->inode_blocks_start +
+				geo->nr_inode_blocks)
+			return -EINVAL;
+		start = gd->data_blocks_start + testfs_group_nr_data_blocks(sb, g);
+	}
+	return 0;
+}
+
+int testfs_inode_group(struct super_block *sb, int inode_nr) {
+	assert(inode_nr >= 0 && inode_nr < sb->geo.nr_inodes);
+	return inode_nr / sb->geo.inodes_per_group;
+}
+
+int testfs_inode_block_nr(struct super_block *sb, int inode_nr) {
+	int g = testfs_inode_group(sb, inode_nr);
+
+	return sb->groups[g].inode_blocks_start +
+		(inode_nr % sb->geo.inodes_per_group) / INODES_PER_BLOCK(sb);
+}
+
+int testfs_data_block_nr(struct super_block *sb, int index) {
+	int g;
+
+	assert(index >= 0 && index < sb->geo.nr_data_blocks);
+	g = index / sb->geo.blocks_per_group;
+	return sb->groups[g].data_blocks_start +
+		index % sb->geo.blocks_per_group;
+}
+
+int testfs_data_block_index(struct super_block *sb, int block_nr) {
+	int g = testfs_block_group(sb, block_nr);
+	int index;
+
+	if (g < 0)
+		return -1;
+	index = block_nr - sb->groups[g].data_blocks_start;
+	if (index < 0 || index >= testfs_group_nr_data_blocks(sb, g))
+		return -1;
+	return g * sb->geo.blocks_per_group + index;
+}
+
+/* the groups are in block order, so this is a binary search */
+int testfs_block_group(struct super_block *sb, int block_nr) {
+	int lo = 0, hi = sb->geo.nr_groups;
+
+	if (block_nr < sb->groups[0].inode_freemap_start)
+		return -1;
+	while (hi - lo > 1) {
+		int mid = (lo + hi) / 2;
+
+		if (sb->groups[mid].inode_freemap_start <= block_nr)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* an ungrouped image keeps the whole checksum table region in memory */
+size_t testfs_csum_table_size(struct super_block *sb) {
+	if (sb->geo.group_desc_size == 0)
+		return (size_t) sb->geo.csum_table_size * BLOCK_SIZE(sb);
+	return (size_t) sb->geo.nr_data_blocks * sizeof(int);
+}
+
+static void testfs_table_slice(struct super_block *sb, enum testfs_table t,
+		int g, struct table_slice *s) {
+	struct testfs_geometry *geo = &sb->geo;
+	struct dgroup_desc *gd = &sb->groups[g];
+	size_t total, off, per;
+
+	switch (t) {
+	case TESTFS_INODE_FREEMAP:
+		s->data = bitmap_getdata(sb->inode_freemap);
+		total = bitmap_getsize(sb->inode_freemap);
+		per = DIVROUNDUP(geo->inodes_per_group, BITS_PER_WORD);
+		off = (size_t) g * geo->inodes_per_group / BITS_PER_WORD;
+		s->start = gd->inode_freemap_start;
+		s->size = geo->inode_freemap_size;
+		s->fill = WORD_ALLBITS;
+		break;
+	case TESTFS_BLOCK_FREEMAP:
+		s->data = bitmap_getdata(sb->block_freemap);
+		total = bitmap_getsize(sb->block_freemap);
+		per = DIVROUNDUP(geo->blocks_per_group, BITS_PER_WORD);
+		off = (size_t) g * geo->blocks_per_group / BITS_PER_WORD;
+		s->start = gd->block_freemap_start;
+		s->size = geo->block_freemap_size;
+		s->fill = WORD_ALLBITS;
+		break;
+	default:
+		s->data = (char *) sb->csum_table;
+		total = testfs_csum_table_size(sb);
+		per = (size_t) geo->blocks_per_group * sizeof(int);
+		off = g * per;
+		s->start = gd->csum_table_start;
+		s->size = geo->csum_table_size;
+		s->fill = 0;
+		break;
+	}
+	assert(s->data && off < total);
+	s->data += off;
+	/* only the entries of group g, the last group takes the rest */
+	s->len = g + 1 < geo->nr_groups ? per : total - off;
+	assert(s->len <= (size_t) s->size * BLOCK_SIZE(sb));
+}
+
+/* write block nr of the region of slice s */
+static void testfs_write_slice(struct super_block *sb, struct table_slice *s,
+		int nr) {
+	size_t off = (size_t) nr * BLOCK_SIZE(sb);
+	char block[BLOCK_SIZE(sb)];
+
+	if (off + BLOCK_SIZE(sb) <= s->len) {
+		write_blocks(sb, s->data + off, s->start + nr, 1);
+		return;
+	}
+	memset(block, s->fill, BLOCK_SIZE(sb));
+	if (off < s->len)
+		memcpy(block, s->data + off, s->len - off);
+	write_blocks(sb, block, s->start + nr, 1);
+}
+
+void testfs_read_table(struct super_block *sb, enum testfs_table t) {
+	int g;
+
+	for (g = 0; g < sb->geo.nr_groups; g++) {
+		struct table_slice s;
+		int full;
+
+		testfs_table_slice(sb, t, g, &s);
+		full = s.len / BLOCK_SIZE(sb);
+		if (full > 0)
+			read_blocks(sb, s.data, s.start, full);
+		if (s.len % BLOCK_SIZE(sb)) {
+			char block[BLOCK_SIZE(sb)];
+
+			read_blocks(sb, block, s.start + full, 1);
+			memcpy(s.data + (size_t) full * BLOCK_SIZE(sb), block,
+					s.len % BLOCK_SIZE(sb));
+		}
+	}
+}
+
+/* find the group and the block of its region that hold entry index of
+ * table t, i.e., the bit of an inode or data block in a freemap or the
+ * checksum of a data block */
+static void testfs_table_locate(struct super_block *sb, enum testfs_table t,
+		int index, int *g, int *nr) {
+	int per_group, entry_bits;
+	size_t off;
+
+	if (t == TESTFS_INODE_FREEMAP) {
+		per_group = sb->geo.inodes_per_group;
+		entry_bits = 1;
+	} else if (t == TESTFS_BLOCK_FREEMAP) {
+		per_group = sb->geo.blocks_per_group;
+		entry_bits = 1;
+	} else {
+		per_group = sb->geo.blocks_per_group;
+		entry_bits = sizeof(int) * BITS_PER_WORD;
+	}
+	*g = index / per_group;
+	off = (size_t) (index % per_group) * entry_bits / BITS_PER_WORD;
+	*nr = off / BLOCK_SIZE(sb);
+}
+
+void testfs_write_table(struct super_block *sb, enum testfs_table t,
+		int index) {
+	testfs_write_table_range(sb, t, index, 1);
+}
+
+/* write the blocks holding entries index to index + nr - 1, skipping the
+ * block *last_nr of group *last_g that was written last */
+static void testfs_write_entries(struct super_block *sb, enum testfs_table t,
+		int index, int nr, int *last_g, int *last_nr) {
+	int i;
+
+	for (i = index; i < index + nr; i++) {
+		struct table_slice s;
+		int g, block_nr;
+
+		testfs_table_locate(sb, t, i, &g, &block_nr);
+		if (g == *last_g && block_nr == *last_nr)
+			continue;
+		testfs_table_slice(sb, t, g, &s);
+		testfs_write_slice(sb, &s, block_nr);
+		*last_g = g;
+		*last_nr = block_nr;
+	}
+}
+
+/* write each block holding entries index to index + nr - 1 once */
+void testfs_write_table_range(struct super_block *sb, enum testfs_table t,
+		int index, int nr) {
+	int last_g = -1, last_nr = -1;
+
+	testfs_write_entries(sb, t, index, nr, &last_g, &last_nr);
+}
+
+/* write each block of a freemap holding bits that changed since the
+ * freemap was last written once */
+void testfs_flush_table(struct super_block *sb, enum testfs_table t) {
+	struct bitmap *b;
+	int last_g = -1, last_nr = -1;
+	u_int32_t lo, hi = 0;
+
+	assert(t != TESTFS_CSUM_TABLE);
+	b = t == TESTFS_INODE_FREEMAP ? sb->inode_freemap : sb->block_freemap;
+	if (!b)
+		return;
+	while (bitmap_next_dirty(b, hi, &lo, &hi) == 0)
+		testfs_write_entries(sb, t, lo, hi - lo, &last_g, &last_nr);
+	bitmap_clean(b);
+}
+
+void testfs_sync_table(struct super_block *sb, enum testfs_table t) {
+	int g;
+
+	for (g = 0; g < sb->geo.nr_groups; g++) {
+		struct table_slice s;
+		int full, nr;
+
+		testfs_table_slice(sb, t, g, &s);
+		full = s.len / BLOCK_SIZE(sb);
+		if (full > 0)
+			write_blocks(sb, s.data, s.start, full);
+		for (nr = full; nr < s.size; nr++)
+			testfs_write_slice(sb, &s, nr);
+	}
+}
+
+/* allocate a clear bit of the inode or block freemap in group goal or,
+ * when it is full, in the groups after it. returns negative value on
+ * error */
+int testfs_alloc_group(struct super_block *sb, enum testfs_table t, int goal,
+		u_int32_t *index) {
+	struct bitmap *b;
+	int per_group, count, i;
+
+	if (t == TESTFS_INODE_FREEMAP) {
+		b = sb->inode_freemap;
+		per_group = sb->geo.inodes_per_group;
+		count = sb->geo.nr_inodes;
+	} else {
+		assert(t == TESTFS_BLOCK_FREEMAP);
+		b = sb->block_freemap;
+		per_group = sb->geo.blocks_per_group;
+		count = sb->geo.nr_data_blocks;
+	}
+	assert(b);
+	assert(goal >= 0 && goal < sb->geo.nr_groups);
+	for (i = 0; i < sb->geo.nr_groups; i++) {
+		int g = (goal + i) % sb->geo.nr_groups;
+		u_int32_t lo = (u_int32_t) g * per_group;
+
+		if (bitmap_alloc_in(b, lo, MIN(lo + per_group, count), index) == 0)
+			return 0;
+	}
+	return -ENOSPC;
+}
+
+/* the extent allocator: the run starts at hint if it is free, otherwise
+ * it is the best fit among the free extents of group goal, or of all
+ * groups if group goal is full */
+static int testfs_alloc_extent_run(struct super_block *sb, int goal, int hint,
+		int want, u_int32_t *index, u_int32_t *got) {
+	int per_group = sb->geo.blocks_per_group;
+	u_int32_t lo = (u_int32_t) goal * per_group;
+	int ret;
+
+	ret = extent_tree_alloc(sb->free_extents, want,
+			hint < 0 ? EXTENT_NO_HINT : (u_int32_t) hint, lo,
+			MIN(lo + per_group, (u_int32_t) sb->geo.nr_data_blocks),
+			per_group, index, got);
+	if (ret < 0)
+		return ret;
+	bitmap_mark_range(sb->block_freemap, *index, *got);
+	return 0;
+}
+
+/* allocate a run of up to want free data blocks, searching from data block
+ * index hint or, if hint is negative, from the cursor of the block freemap
+ * when it is in group goal, or from the start of the group. the run does
+ * not cross a group boundary, since the data blocks of adjacent groups
+ * are not adjacent on disk. returns negative value on error */
+int testfs_alloc_group_run(struct super_block *sb, int goal, int hint,
+		int want, u_int32_t *index, u_int32_t *got) {
+	struct bitmap *b = sb->block_freemap;
+	int per_group = sb->geo.blocks_per_group;
+	u_int32_t end;
+	int ret;
+
+	assert(b);
+	assert(goal >= 0 && goal < sb->geo.nr_groups);
+	if (sb->free_extents)
+		return testfs_alloc_extent_run(sb, goal, hint, want, index, got);
+	if (hint < 0) {
+		u_int32_t lo = (u_int32_t) goal * per_group;
+		u_int32_t cursor = bitmap_get_cursor(b);
+
+		hint = (cursor >= lo && cursor < lo + per_group) ? cursor : lo;
+	}
+	ret = bitmap_alloc_range(b, want, hint, index, got);
+	if (ret < 0)
+		return ret;
+	end = (*index / per_group + 1) * per_group;
+	if (*index + *got > end) {
+		bitmap_unmark_range(b, end, *index + *got - end);
+		*got = end - *index;
+	}
+	return 0;
+}
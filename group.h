@@ -0,0 +1,87 @@
+#ifndef _GROUP_H
+#define _GROUP_H
+
+#include <sys/types.h>
+
+/*
+ * Block groups.
+ *
+ * The inodes and data blocks of an image are split into groups of
+ * inodes_per_group consecutive inode numbers and blocks_per_group
+ * consecutive data block indexes (data blocks are numbered from 0 across
+ * all groups, the last group may be short). Each group keeps its slice of
+ * the inode freemap, the block freemap and the checksum table next to its
+ * inodes and data blocks, so an inode, its data blocks and their checksums
+ * are close together on disk. The group descriptors locating these regions
+ * follow the super block and are read at mount time.
+ *
+ * Images with the default geometry, and images written before block groups
+ * existed, are a single group described by the start fields of the
+ * dsuper_block.
+ *
+ * In memory the freemaps and the checksum table remain single tables,
+ * indexed by inode number and data block index.
+ *
+ * Functions:
+ *     testfs_make_groups      - lay out the groups of a new image and write
+ *                               their descriptors.
+ *     testfs_read_groups      - read and check the group descriptors.
+ *     testfs_inode_group      - group of an inode.
+ *     testfs_inode_block_nr   - block holding an inode.
+ *     testfs_data_block_nr    - block number of a data block index.
+ *     testfs_data_block_index - data block index of a block number, or -1
+ *                               if it is not a data block.
+ *     testfs_block_group      - group containing a block number, or -1 for
+ *                               the super block and group descriptors.
+ *     testfs_csum_table_size  - size in bytes of the in-memory checksum
+ *                               table.
+ *     testfs_read_table       - read a table from all groups.
+ *     testfs_write_table      - write the block of a table holding an entry.
+ *     testfs_write_table_range - same, for a range of entries.
+ *     testfs_sync_table       - write a table to all groups.
+ *     testfs_flush_table      - write the blocks of a freemap that hold
+ *                               changed bits.
+ *     testfs_alloc_group      - allocate a bit of a freemap, from a goal
+ *                               group or the groups after it.
+ *     testfs_alloc_group_run  - allocate a run of data blocks within one
+ *                               group, near a hint or in a goal group,
+ *                               with the allocator of the image.
+ */
+
+struct super_block;
+
+struct dgroup_desc {
+        int inode_freemap_start;
+        int block_freemap_start;
+        int csum_table_start;
+        int inode_blocks_start;
+        int data_blocks_start;
+} __attribute__((packed));
+
+enum testfs_table {
+        TESTFS_INODE_FREEMAP,
+        TESTFS_BLOCK_FREEMAP,
+        TESTFS_CSUM_TABLE,
+};
+
+int testfs_make_groups(struct super_block *sb);
+int testfs_read_groups(struct super_block *sb);
+int testfs_inode_group(struct super_block *sb, int inode_nr);
+int testfs_inode_block_nr(struct super_block *sb, int inode_nr);
+int testfs_data_block_nr(struct super_block *sb, int index);
+int testfs_data_block_index(struct super_block *sb, int block_nr);
+int testfs_block_group(struct super_block *sb, int block_nr);
+size_t testfs_csum_table_size(struct super_block *sb);
+void testfs_read_table(struct super_block *sb, enum testfs_table t);
+void testfs_write_table(struct super_block *sb, enum testfs_table t,
+                        int index);
+void testfs_write_table_range(struct super_block *sb, enum testfs_table t,
+                              int index, int nr);
+void testfs_sync_table(struct super_block *sb, enum testfs_table t);
+void testfs_flush_table(struct super_block *sb, enum testfs_table t);
+int testfs_alloc_group(struct super_block *sb, enum testfs_table t, int goal,
+                       u_int32_t *index);
+int testfs_alloc_group_run(struct super_block *sb, int goal, int hint,
+                           int want, u_int32_t *index, u_int32_t *got);
+
+#endif /* _GROUP_H */
@@ -1,50 +1,232 @@
+#include <stdint.h>
 #include "testfs.h"
 #include "super.h"
 #include "block.h"
 #include "inode.h"
 #include "list.h"
 #include "csum.h"
+#include "group.h"
 
 /* inode flags */
 #define I_FLAGS_DIRTY     0x1
+#define I_FLAGS_QUEUED    0x2   /* on inode_dirty, written back at commit */
 
 struct inode {
 	int i_flags;
 	struct dinode in;
 	int i_nr;
 	struct hlist_node hnode; /* keep these structures in a hash table */
+	struct list_head lru;   /* on inode_lru while i_count is 0 */
+	struct list_head dirty; /* on inode_dirty while I_FLAGS_QUEUED */
 	int i_count;
 	struct super_block *sb;
+	int i_ra_next;          /* logical block after the last read */
+	int i_ra_end;           /* logical block after the readahead window */
 };
 
-static struct hlist_head *inode_hash_table = NULL;
+/*
+ * struct inodes are allocated from slabs of INODE_SLAB_NR objects, each
+ * one aligned to and padded to a whole number of cache lines. freed
+ * inodes go back on a free list and are reused, the slabs are released
+ * when the last file system is unmounted.
+ */
+#define INODE_SLAB_ALIGN 64     /* cache line size */
+#define INODE_SLAB_NR 64        /* inodes per slab */
+#define INODE_OBJ_SIZE ROUNDUP(sizeof(struct inode), INODE_SLAB_ALIGN)
+#define INODE_SLAB_HDR ROUNDUP(sizeof(struct inode_slab), INODE_SLAB_ALIGN)
 
-#define INODE_HASH_SHIFT 8
+struct inode_slab {
+	struct inode_slab *next;        /* all slabs */
+};
 
-#define inode_hashfn(nr)	\
-	hash_int((unsigned int)nr, INODE_HASH_SHIFT)
+struct inode_free {
+	struct inode_free *next;        /* free list, in the free object */
+};
 
-static const int inode_hash_size = (1 << INODE_HASH_SHIFT);
+static struct inode_slab *inode_slabs = NULL;
+static struct inode_free *inode_free_list = NULL;
+static struct inode_slab_stats inode_slab_stats;
 
-void inode_hash_init(void) {
+/* add a slab and put its objects on the free list */
+static void inode_slab_grow(void) {
+	struct inode_slab *slab;
+	char *obj;
 	int i;
-	// hash table is of size 256 bytes
-	inode_hash_table = malloc(inode_hash_size * sizeof(struct hlist_head));
-	if (!inode_hash_table) {
-		EXIT("malloc");
+
+	if (posix_memalign((void **) &slab, INODE_SLAB_ALIGN,
+				INODE_SLAB_HDR + INODE_SLAB_NR * INODE_OBJ_SIZE)) {
+		EXIT("posix_memalign");
 	}
-	for (i = 0; i < inode_hash_size; i++) {
-		INIT_HLIST_HEAD(&inode_hash_table[i]);
+	slab->next = inode_slabs;
+	inode_slabs = slab;
+	obj = (char *) slab + INODE_SLAB_HDR;
+	for (i = INODE_SLAB_NR - 1; i >= 0; i--) {
+		struct inode_free *f =
+			(struct inode_free *) (obj + i * INODE_OBJ_SIZE);
+
+		f->next = inode_free_list;
+		inode_free_list = f;
 	}
+	inode_slab_stats.slabs++;
 }
 
-void inode_hash_destroy(void) {
+/* return a zeroed inode */
+static struct inode *inode_slab_alloc(void) {
+	struct inode_free *f;
+
+	if (inode_free_list) {
+		inode_slab_stats.hits++;
+	} else {
+		inode_slab_stats.misses++;
+		inode_slab_grow();
+	}
+	f = inode_free_list;
+	inode_free_list = f->next;
+	inode_slab_stats.in_use++;
+	bzero(f, sizeof(struct inode));
+	return (struct inode *) f;
+}
+
+static void inode_slab_free(struct inode *in) {
+	struct inode_free *f = (struct inode_free *) in;
+
+	f->next = inode_free_list;
+	inode_free_list = f;
+	inode_slab_stats.in_use--;
+}
+
+/* release all the slabs, no inode may be in use */
+static void inode_slab_destroy(void) {
+	assert(inode_slab_stats.in_use == 0);
+	while (inode_slabs) {
+		struct inode_slab *slab = inode_slabs;
+
+		inode_slabs = slab->next;
+		free(slab);
+	}
+	inode_free_list = NULL;
+	inode_slab_stats.slabs = 0;
+}
+
+void inode_slab_get_stats(struct inode_slab_stats *stats) {
+	*stats = inode_slab_stats;
+}
+
+/*
+ * The inode hash table grows when it holds more inodes than buckets and
+ * shrinks when it holds fewer than one inode per 8 buckets. A resize
+ * allocates the new bucket array and then moves the inodes of the old
+ * one over a few buckets at a time, on each later find, insert or
+ * remove, so no single operation pays for a full rehash. While a resize
+ * is in progress, buckets of the old array below inode_rehash_pos have
+ * been moved, and lookups look at both arrays.
+ *
+ * The table is shared by all mounted file systems, the hash of an inode
+ * mixes its super block with its number.
+ */
+struct inode_hash {
+	struct hlist_head *buckets;
+	int shift;              /* 1 << shift buckets */
+};
+
+#define INODE_HASH_MIN_SHIFT 8
+#define INODE_HASH_MAX_SHIFT 24
+#define INODE_REHASH_STEP 4     /* old buckets moved per hash operation */
+
+static struct inode_hash inode_hash_table;      /* inserts go here */
+static struct inode_hash inode_hash_old;        /* being moved, if resizing */
+static int inode_rehash_pos = -1;               /* -1 when not resizing */
+static int inode_hash_count = 0;                /* inodes in the table */
+static int inode_hash_users = 0;                /* inode_hash_init calls */
+
+static inline unsigned int
+inode_hashfn(struct super_block *sb, int inode_nr, int shift) {
+	unsigned long long p = (unsigned long long) (uintptr_t) sb;
+	unsigned int salt = hash_int((unsigned int) (p ^ (p >> 32)), 32);
+
+	return hash_int((unsigned int) inode_nr ^ salt, shift);
+}
+
+static inline struct hlist_head *
+inode_hash_bucket(struct inode_hash *h, struct super_block *sb, int inode_nr) {
+	return &h->buckets[inode_hashfn(sb, inode_nr, h->shift)];
+}
+
+/* inodes that are no longer referenced stay in the hash table, on an LRU
+ * list, until more than inode_lru_capacity of them are kept. the most
+ * recently released inode is at the head */
+static struct list_head inode_lru;
+static int inode_lru_len = 0;
+static int inode_lru_capacity = INODE_CACHE_DEFAULT;
+
+/* inodes synced during a transaction are queued here, holding a
+ * reference, and written back by testfs_flush_inodes at commit */
+static struct list_head inode_dirty;
+
+static void inode_hash_alloc(struct inode_hash *h, int shift) {
 	int i;
-	assert(inode_hash_table);
-	for (i = 0; i < inode_hash_size; i++) {
-		assert(hlist_empty(&inode_hash_table[i]));
+
+	h->shift = shift;
+	h->buckets = malloc((1 << shift) * sizeof(struct hlist_head));
+	if (!h->buckets) {
+		EXIT("malloc");
+	}
+	for (i = 0; i < (1 << shift); i++) {
+		INIT_HLIST_HEAD(&h->buckets[i]);
+	}
+}
+
+/* move up to nr buckets of the old array to the current one */
+static void inode_rehash_step(int nr) {
+	if (inode_rehash_pos < 0)
+		return;
+	for (; nr > 0 && inode_rehash_pos < (1 << inode_hash_old.shift);
+			nr--, inode_rehash_pos++) {
+		struct hlist_head *head =
+			&inode_hash_old.buckets[inode_rehash_pos];
+
+		while (!hlist_empty(head)) {
+			struct hlist_node *node = head->first;
+			struct inode *in = hlist_entry(node, struct inode, hnode);
+
+			hlist_del(node);
+			hlist_add_head(node, inode_hash_bucket(&inode_hash_table,
+						in->sb, in->i_nr));
+		}
+	}
+	if (inode_rehash_pos == (1 << inode_hash_old.shift)) {
+		free(inode_hash_old.buckets);
+		inode_hash_old.buckets = NULL;
+		inode_rehash_pos = -1;
 	}
-	free(inode_hash_table);
+}
+
+/* start a resize if the load factor is out of bounds */
+static void inode_hash_check_load(void) {
+	int shift = inode_hash_table.shift;
+
+	if (inode_rehash_pos >= 0)
+		return;
+	if (inode_hash_count > (1 << shift) && shift < INODE_HASH_MAX_SHIFT)
+		shift++;
+	else if (inode_hash_count < (1 << shift) / 8 &&
+			shift > INODE_HASH_MIN_SHIFT)
+		shift--;
+	else
+		return;
+	inode_hash_old = inode_hash_table;
+	inode_hash_alloc(&inode_hash_table, shift);
+	inode_rehash_pos = 0;
+}
+
+void inode_hash_init(void) {
+	if (inode_hash_users++ > 0)
+		return;
+	inode_hash_alloc(&inode_hash_table, INODE_HASH_MIN_SHIFT);
+	inode_hash_count = 0;
+	INIT_LIST_HEAD(&inode_lru);
+	inode_lru_len = 0;
+	INIT_LIST_HEAD(&inode_dirty);
 }
 
 static struct inode *
@@ -52,8 +234,20 @@ inode_hash_find(struct super_block *sb, int inode_nr) {
 	struct hlist_node *elem;
 	struct inode *in;
 
+	inode_rehash_step(INODE_REHASH_STEP);
+	hlist_for_each_entry(in, elem,
+			inode_hash_bucket(&inode_hash_table, sb, inode_nr), hnode)
+	{
+		if ((in->sb == sb) && (in->i_nr == inode_nr)) {
+			return in;
+		}
+	}
+	if (inode_rehash_pos < 0 ||
+			(int) inode_hashfn(sb, inode_nr, inode_hash_old.shift) <
+			inode_rehash_pos)
+		return NULL;
 	hlist_for_each_entry(in, elem,
-			&inode_hash_table[inode_hashfn(inode_nr)], hnode)
+			inode_hash_bucket(&inode_hash_old, sb, inode_nr), hnode)
 	{
 		if ((in->sb == sb) && (in->i_nr == inode_nr)) {
 			return in;
@@ -63,76 +257,375 @@ inode_hash_find(struct super_block *sb, int inode_nr) {
 }
 
 static void inode_hash_insert(struct inode *in) {
+	inode_rehash_step(INODE_REHASH_STEP);
 	INIT_HLIST_NODE(&in->hnode);
-	hlist_add_head(&in->hnode, &inode_hash_table[inode_hashfn(in->i_nr)]);
+	hlist_add_head(&in->hnode,
+			inode_hash_bucket(&inode_hash_table, in->sb, in->i_nr));
+	inode_hash_count++;
+	inode_hash_check_load();
 }
 
 static void inode_hash_remove(struct inode *in) {
+	inode_rehash_step(INODE_REHASH_STEP);
 	hlist_del(&in->hnode);
+	inode_hash_count--;
+	inode_hash_check_load();
+}
+
+/* free the least recently released inodes until at most capacity are
+ * kept */
+static void inode_lru_shrink(int capacity) {
+	while (inode_lru_len > capacity) {
+		struct inode *in = list_entry(inode_lru.prev, struct inode, lru);
+
+		assert(in->i_count == 0);
+		list_del(&in->lru);
+		inode_lru_len--;
+		inode_hash_remove(in);
+		inode_slab_free(in);
+	}
+}
+
+/* set the nr of unreferenced inodes that are kept, 0 disables caching */
+void inode_cache_resize(int capacity) {
+	assert(capacity >= 0);
+	inode_lru_capacity = capacity;
+	if (inode_hash_users > 0)
+		inode_lru_shrink(capacity);
+}
+
+/* drop the cached inodes. the table is freed by the last user, all the
+ * inodes must have been put by then */
+void inode_hash_destroy(void) {
+	assert(inode_hash_users > 0);
+	inode_lru_shrink(0);
+	if (--inode_hash_users > 0)
+		return;
+	assert(inode_hash_count == 0);
+	assert(list_empty(&inode_dirty));
+	inode_rehash_step(1 << INODE_HASH_MAX_SHIFT);
+	free(inode_hash_table.buckets);
+	inode_hash_table.buckets = NULL;
+	inode_slab_destroy();
+}
+
+/* print the state of the inode cache and of the inode slabs */
+int cmd_icache(struct super_block *sb, struct context *c) {
+	struct inode_slab_stats st;
+
+	if (c->nargs != 1) {
+		return -EINVAL;
+	}
+	inode_slab_get_stats(&st);
+	printf("inodes = %d, unreferenced = %d (capacity %d)\n",
+			inode_hash_count, inode_lru_len, inode_lru_capacity);
+	printf("hash buckets = %d%s\n", 1 << inode_hash_table.shift,
+			inode_rehash_pos >= 0 ? " (resizing)" : "");
+	printf("slabs = %lu (%d inodes of %d bytes each), in use = %lu\n",
+			st.slabs, INODE_SLAB_NR, (int) INODE_OBJ_SIZE, st.in_use);
+	printf("slab hits = %lu, misses = %lu\n", st.hits, st.misses);
+	return 0;
 }
 
 /*
  Blocks are maintained both on disk and in memory.
  the inode structure that is represented on disk is called
- a dinode. the INODES_PER_BLOCK is computed by calculating
- the BLOCK_SIZE / dinode size.
+ a dinode. the INODES_PER_BLOCK(sb) is computed by calculating
+ the BLOCK_SIZE(sb) / dinode size.
  */
 
 static int testfs_inode_to_block_nr(struct inode *in) {
-	int block_nr = in->i_nr / INODES_PER_BLOCK;
+	int block_nr = testfs_inode_block_nr(in->sb, in->i_nr);
 	assert(block_nr >= 0);
-	assert(block_nr < NR_INODE_BLOCKS);
 	return block_nr;
 }
 
 static int testfs_inode_to_block_offset(struct inode *in) {
-	int block_offset = (in->i_nr % INODES_PER_BLOCK) * sizeof(struct dinode);
+	int block_offset = (in->i_nr % INODES_PER_BLOCK(in->sb)) *
+		sizeof(struct dinode);
 	assert(block_offset >= 0);
-	assert(block_offset < BLOCK_SIZE);
+	assert(block_offset < BLOCK_SIZE(in->sb));
 	return block_offset;
 }
 
 static void testfs_read_inode_block(struct inode *in, char *block) {
 	int block_nr = testfs_inode_to_block_nr(in);
 	// read from in->sb into block buffer.
-	read_blocks(in->sb, block, in->sb->sb.inode_blocks_start + block_nr, 1);
+	read_blocks(in->sb, block, block_nr, 1);
 }
 
 static void testfs_write_inode_block(struct inode *in, char *block) {
 	int block_nr = testfs_inode_to_block_nr(in);
-	write_blocks(in->sb, block, in->sb->sb.inode_blocks_start + block_nr, 1);
+	write_blocks(in->sb, block, block_nr, 1);
 }
 
-/* given logical block number, read physical block
- * return physical block number.
+/* extents of an inode, see inode.h */
+
+static inline int testfs_ext_nr(struct inode *in) {
+	return in->in.i_ext_header & I_EXT_NR_MASK;
+}
+
+/* copy the extents of in into ext[NR_EXTENTS(sb)], reading the overflow
+ * block if there is one. returns the nr of extents */
+static int testfs_ext_load(struct inode *in, struct dextent *ext) {
+	char block[BLOCK_SIZE(in->sb)];
+	int nr = testfs_ext_nr(in);
+
+	if (nr > 0)
+		ext[0] = in->in.i_ext;
+	if (nr > 1) {
+		read_blocks(in->sb, block, in->in.i_ext_block, 1);
+		memcpy(ext + 1, block, (nr - 1) * sizeof(struct dextent));
+	}
+	return nr;
+}
+
+/* make ext[nr] the extents of in. the overflow block is allocated when
+ * more than one extent is needed and freed when it is no longer needed.
+ * returns negative value on error */
+static int testfs_ext_store(struct inode *in, struct dextent *ext, int nr) {
+	char block[BLOCK_SIZE(in->sb)];
+
+	assert(nr >= 0 && nr <= NR_EXTENTS(in->sb));
+	if (nr > 1) {
+		if (in->in.i_ext_block == 0) {
+			int got;
+			int ret = testfs_alloc_blocks(in->sb,
+					testfs_inode_group(in->sb, in->i_nr), 0, 1, &got);
+
+			if (ret < 0)
+				return ret;
+			in->in.i_ext_block = ret;
+		}
+		bzero(block, BLOCK_SIZE(in->sb));
+		memcpy(block, ext + 1, (nr - 1) * sizeof(struct dextent));
+		write_blocks(in->sb, block, in->in.i_ext_block, 1);
+	} else if (in->in.i_ext_block != 0) {
+		testfs_free_block(in->sb, in->in.i_ext_block);
+		in->in.i_ext_block = 0;
+	}
+	if (nr > 0)
+		in->in.i_ext = ext[0];
+	else
+		bzero(&in->in.i_ext, sizeof(struct dextent));
+	in->in.i_ext_header = I_EXT_MAGIC | nr;
+	in->i_flags |= I_FLAGS_DIRTY;
+	return 0;
+}
+
+/* index of the extent of ext[nr] holding log_block_nr, or -1 */
+static int testfs_ext_find(struct dextent *ext, int nr, int log_block_nr) {
+	int lo = 0, hi = nr;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (log_block_nr < ext[mid].e_logical)
+			hi = mid;
+		else if (log_block_nr >= ext[mid].e_logical + ext[mid].e_len)
+			lo = mid + 1;
+		else
+			return mid;
+	}
+	return -1;
+}
+
+/* map log_block_nr of an extent inode, 0 if it is not mapped */
+static int testfs_ext_bmap(struct inode *in, int log_block_nr) {
+	struct dextent ext[NR_EXTENTS(in->sb)];
+	int nr = testfs_ext_load(in, ext);
+	int i = testfs_ext_find(ext, nr, log_block_nr);
+
+	if (i < 0)
+		return 0;
+	return ext[i].e_physical + (log_block_nr - ext[i].e_logical);
+}
+
+/* same as testfs_bmap_range, for extent inodes. the mapping is looked up
+ * once and each extent fills the vec with a run of blocks */
+static int testfs_ext_bmap_range(struct inode *in, int log_block_nr, int cnt,
+		struct block_vec *vec) {
+	struct dextent ext[NR_EXTENTS(in->sb)];
+	int nr = testfs_ext_load(in, ext);
+	int e = testfs_ext_find(ext, nr, log_block_nr);
+	int i = 0;
+
+	if (e < 0)
+		return 0;
+	for (; e < nr && i < cnt; e++) {
+		int off = log_block_nr + i - ext[e].e_logical;
+
+		assert(off >= 0);
+		for (; off < ext[e].e_len && i < cnt; off++, i++) {
+			vec[i].bv_nr = ext[e].e_physical + off;
+			vec[i].bv_data = NULL;
+		}
+	}
+	return i;
+}
+
+/* map the run of nr blocks from phy_block_nr on at log_block_nr, the
+ * first unmapped block of in, whose extents are ext[n]. the run extends
+ * the last extent if it follows it on disk.
+ * returns negative value on error */
+static int testfs_ext_append(struct inode *in, struct dextent *ext, int n,
+		int log_block_nr, int phy_block_nr, int nr) {
+	struct dextent *last = n > 0 ? &ext[n - 1] : NULL;
+
+	assert(log_block_nr == (last ? last->e_logical + last->e_len : 0));
+	if (last && last->e_physical + last->e_len == phy_block_nr) {
+		last->e_len += nr;
+	} else {
+		if (n == NR_EXTENTS(in->sb))
+			return -EFBIG;
+		ext[n].e_logical = log_block_nr;
+		ext[n].e_physical = phy_block_nr;
+		ext[n].e_len = nr;
+		n++;
+	}
+	return testfs_ext_store(in, ext, n);
+}
+
+/* free the blocks of an extent inode from logical block s_block_nr on, a
+ * run at a time */
+static void testfs_ext_truncate(struct inode *in, int s_block_nr) {
+	struct dextent ext[NR_EXTENTS(in->sb)];
+	int nr = testfs_ext_load(in, ext);
+	int ret;
+
+	while (nr > 0 &&
+			ext[nr - 1].e_logical + ext[nr - 1].e_len > s_block_nr) {
+		struct dextent *e = &ext[nr - 1];
+		int keep = MAX(s_block_nr - e->e_logical, 0);
+
+		testfs_free_blocks(in->sb, e->e_physical + keep, e->e_len - keep);
+		if (keep > 0) {
+			e->e_len = keep;
+			break;
+		}
+		nr--;
+	}
+	/* fewer extents never need a new overflow block */
+	ret = testfs_ext_store(in, ext, nr);
+	assert(ret == 0);
+}
+
+/* given logical block number, return physical block number without
+ * reading the block itself.
  * returns 0 if physical block does not exist.
  * returns negative value on other errors. */
-
-// also reads the block into block buffer.
-static int testfs_get_block(struct inode *in, char *block, int log_block_nr) {
-	int phy_block_nr;
+static int testfs_bmap(struct inode *in, int log_block_nr) {
+	char indirect[BLOCK_SIZE(in->sb)];
 
 	assert(log_block_nr >= 0);
-	if (log_block_nr < NR_DIRECT_BLOCKS) {
-		phy_block_nr = in->in.i_block_nr[log_block_nr];
-		goto read_block;
-	}
+	if (I_HAS_EXTENTS(&in->in))
+		return testfs_ext_bmap(in, log_block_nr);
+	if (log_block_nr < NR_DIRECT_BLOCKS)
+		return in->in.i_block_nr[log_block_nr];
 	log_block_nr -= NR_DIRECT_BLOCKS;
-	if (log_block_nr >= NR_INDIRECT_BLOCKS)
+	if (log_block_nr >= NR_INDIRECT_BLOCKS(in->sb))
 		return -EFBIG;
 	if (in->in.i_indirect == 0)
 		return 0;
-	read_blocks(in->sb, block, in->in.i_indirect, 1);
-	phy_block_nr = ((int *) block)[log_block_nr];
-	read_block: if (phy_block_nr > 0)
+	read_blocks(in->sb, indirect, in->in.i_indirect, 1);
+	return ((int *) indirect)[log_block_nr];
+}
+
+/* map up to cnt logical blocks from log_block_nr into vec, reading the
+ * indirect block at most once. stops at the first hole.
+ * returns the number of blocks mapped. */
+static int testfs_bmap_range(struct inode *in, int log_block_nr, int cnt,
+		struct block_vec *vec) {
+	char indirect[BLOCK_SIZE(in->sb)];
+	int have_indirect = 0;
+	int i, phy_block_nr;
+
+	if (I_HAS_EXTENTS(&in->in))
+		return testfs_ext_bmap_range(in, log_block_nr, cnt, vec);
+	for (i = 0; i < cnt; i++, log_block_nr++) {
+		if (log_block_nr < NR_DIRECT_BLOCKS) {
+			phy_block_nr = in->in.i_block_nr[log_block_nr];
+		} else if (log_block_nr - NR_DIRECT_BLOCKS >=
+				NR_INDIRECT_BLOCKS(in->sb) || in->in.i_indirect == 0) {
+			break;
+		} else {
+			if (!have_indirect) {
+				read_blocks(in->sb, indirect, in->in.i_indirect, 1);
+				have_indirect = 1;
+			}
+			phy_block_nr =
+				((int *) indirect)[log_block_nr - NR_DIRECT_BLOCKS];
+		}
+		if (phy_block_nr <= 0)
+			break;
+		vec[i].bv_nr = phy_block_nr;
+		vec[i].bv_data = NULL;
+	}
+	return i;
+}
+
+/* given logical block number, read physical block
+ * return physical block number.
+ * returns 0 if physical block does not exist.
+ * returns negative value on other errors. */
+
+// also reads the block into block buffer.
+static int testfs_get_block(struct inode *in, char *block, int log_block_nr) {
+	int phy_block_nr = testfs_bmap(in, log_block_nr);
+
+	if (phy_block_nr > 0)
 		read_blocks(in->sb, block, phy_block_nr, 1);
 	return phy_block_nr;
 }
 
-static int testfs_allocate_block(struct inode *in, char *block,
+/* blocks allocated ahead for the rest of a testfs_write_data call, so that
+ * the blocks of a write are contiguous on disk */
+struct block_rsv {
+	int next;       /* next reserved block */
+	int count;      /* nr of reserved blocks left */
+	int want;       /* nr of blocks the rest of the write may need */
+};
+
+/* refill an empty reservation with a run of up to rsv->want blocks,
+ * following the block of log_block_nr - 1 if there is one.
+ * returns negative value on error. */
+static int testfs_rsv_fill(struct inode *in, struct block_rsv *rsv,
 		int log_block_nr) {
-	char indirect[BLOCK_SIZE];
+	int goal = log_block_nr > 0 ? testfs_bmap(in, log_block_nr - 1) : 0;
+	int ret;
+
+	assert(rsv->count == 0);
+	// data blocks go into the group of the inode
+	ret = testfs_alloc_blocks(in->sb, testfs_inode_group(in->sb, in->i_nr),
+			goal > 0 ? goal + 1 : 0, MAX(rsv->want, 1), &rsv->count);
+	if (ret < 0)
+		return ret;
+	rsv->next = ret;
+	return 0;
+}
+
+/* take a block for log_block_nr from the reservation, refilling it if it
+ * is empty.
+ * zeroes block. returns negative value on error. */
+static int testfs_rsv_block(struct inode *in, struct block_rsv *rsv,
+		int log_block_nr, char *block) {
+	if (rsv->count == 0) {
+		int ret = testfs_rsv_fill(in, rsv, log_block_nr);
+
+		if (ret < 0)
+			return ret;
+	}
+	rsv->count--;
+	rsv->want--;
+	bzero(block, BLOCK_SIZE(in->sb));
+	return rsv->next++;
+}
+
+static int testfs_allocate_block(struct inode *in, char *block,
+		int log_block_nr, struct block_rsv *rsv) {
+	char indirect[BLOCK_SIZE(in->sb)];
 	int phy_block_nr;
+	int orig_log_block_nr = log_block_nr;
 
 	assert(log_block_nr >= 0);
 	// this reads log_block_nr inside block buffer, and returns
@@ -144,8 +637,8 @@ static int testfs_allocate_block(struct inode *in, char *block,
 	// otherwise we will need to allocate a new physical block
 	if (log_block_nr < NR_DIRECT_BLOCKS) {
 		// initializes block buffer with 0.
-		// uses in->sb to allocate block in block freemap
-		phy_block_nr = testfs_alloc_block(in->sb, block);
+		// takes the block from the reservation of the write
+		phy_block_nr = testfs_rsv_block(in, rsv, log_block_nr, block);
 		// error in allocating block in freemap, return 
 		// -ENOSPC
 		if (phy_block_nr < 0)
@@ -156,13 +649,14 @@ static int testfs_allocate_block(struct inode *in, char *block,
 		return phy_block_nr;
 	}
 	log_block_nr -= NR_DIRECT_BLOCKS;
-	assert(log_block_nr < NR_INDIRECT_BLOCKS);
+	assert(log_block_nr < NR_INDIRECT_BLOCKS(in->sb));
 	// if there are no indirect blocks, assign a new inode
 	// and point indirect block pointer to that newly created
 	// block.
 	if (in->in.i_indirect == 0) {
 		// indirect is the temporary char block we take here
-		phy_block_nr = testfs_alloc_block(in->sb, indirect);
+		phy_block_nr = testfs_rsv_block(in, rsv, orig_log_block_nr,
+				indirect);
 		if (phy_block_nr < 0)
 			return phy_block_nr;
 		in->in.i_indirect = phy_block_nr;
@@ -173,7 +667,7 @@ static int testfs_allocate_block(struct inode *in, char *block,
 		read_blocks(in->sb, indirect, in->in.i_indirect, 1);
 	}
 	// allocate a new block and make logical to physical block mapping
-	phy_block_nr = testfs_alloc_block(in->sb, block);
+	phy_block_nr = testfs_rsv_block(in, rsv, orig_log_block_nr, block);
 	if (phy_block_nr > 0)
 		((int *) indirect)[log_block_nr] = phy_block_nr;
 	// write the indirect buffer to disk
@@ -181,6 +675,61 @@ static int testfs_allocate_block(struct inode *in, char *block,
 	return phy_block_nr;
 }
 
+/* the run of blocks last mapped by testfs_ext_allocate_block */
+struct map_run {
+	int log;        /* first logical block */
+	int phy;        /* first physical block */
+	int len;        /* nr of blocks, 0 if none */
+	int fresh;      /* the blocks were allocated by this write */
+};
+
+/* same as testfs_allocate_block, for extent inodes. the extents are only
+ * looked at when log_block_nr is not in the last run mapped. a block
+ * past the end of the mapping starts a new run of up to want blocks,
+ * taken from the reservation at once. */
+static int testfs_ext_allocate_block(struct inode *in, char *block,
+		int log_block_nr, int want, struct block_rsv *rsv,
+		struct map_run *run) {
+	struct dextent ext[NR_EXTENTS(in->sb)];
+	int phy_block_nr, nr, i, ret;
+
+	if (log_block_nr < run->log || log_block_nr >= run->log + run->len) {
+		nr = testfs_ext_load(in, ext);
+		i = testfs_ext_find(ext, nr, log_block_nr);
+		if (i >= 0) {
+			run->log = log_block_nr;
+			run->phy = ext[i].e_physical +
+				(log_block_nr - ext[i].e_logical);
+			run->len = ext[i].e_logical + ext[i].e_len - log_block_nr;
+			run->fresh = 0;
+		} else {
+			if (rsv->count == 0) {
+				ret = testfs_rsv_fill(in, rsv, log_block_nr);
+				if (ret < 0)
+					return ret;
+			}
+			want = MIN(want, rsv->count);
+			ret = testfs_ext_append(in, ext, nr, log_block_nr, rsv->next,
+					want);
+			if (ret < 0)
+				return ret;
+			run->log = log_block_nr;
+			run->phy = rsv->next;
+			run->len = want;
+			run->fresh = 1;
+			rsv->next += want;
+			rsv->count -= want;
+			rsv->want -= want;
+		}
+	}
+	phy_block_nr = run->phy + (log_block_nr - run->log);
+	if (run->fresh)
+		bzero(block, BLOCK_SIZE(in->sb));
+	else
+		read_blocks(in->sb, block, phy_block_nr, 1);
+	return phy_block_nr;
+}
+
 /*
  inode already exists on disk. but it may or may not exist in memory.
  If the inode does not exist in memory, create one
@@ -193,18 +742,19 @@ static int testfs_allocate_block(struct inode *in, char *block,
 
 struct inode *
 testfs_get_inode(struct super_block *sb, int inode_nr) {
-	char block[BLOCK_SIZE];
+	char block[BLOCK_SIZE(sb)];
 	int block_offset;
 	struct inode *in;
 
 	in = inode_hash_find(sb, inode_nr);
 	if (in) {
-		in->i_count++;
+		if (in->i_count++ == 0) {
+			list_del(&in->lru);
+			inode_lru_len--;
+		}
 		return in;
 	}
-	if ((in = calloc(1, sizeof(struct inode))) == NULL) {
-		EXIT("calloc");
-	}
+	in = inode_slab_alloc();
 	in->i_flags = 0;
 	in->i_nr = inode_nr;
 	in->sb = sb;
@@ -224,23 +774,87 @@ testfs_get_inode(struct super_block *sb, int inode_nr) {
 	return in;
 }
 
+/* within a transaction the inode is only queued, it is written back with
+ * the other inodes of its block at commit. outside of one it is written
+ * back now */
 void testfs_sync_inode(struct inode *in) {
-	char block[BLOCK_SIZE];
+	char block[BLOCK_SIZE(in->sb)];
 	int block_offset;
 
 	assert(in->i_flags & I_FLAGS_DIRTY);
+	in->i_flags &= ~I_FLAGS_DIRTY;
+	if (in->sb->tx_in_progress != TX_NONE) {
+		if ((in->i_flags & I_FLAGS_QUEUED) == 0) {
+			in->i_flags |= I_FLAGS_QUEUED;
+			in->i_count++;
+			list_add_tail(&in->dirty, &inode_dirty);
+		}
+		return;
+	}
 	testfs_read_inode_block(in, block);
 	block_offset = testfs_inode_to_block_offset(in);
 	memcpy(block + block_offset, &in->in, sizeof(struct dinode));
 	testfs_write_inode_block(in, block);
-	in->i_flags &= ~I_FLAGS_DIRTY;
+}
+
+static int testfs_inode_cmp(const void *a, const void *b) {
+	const struct inode *x = *(struct inode * const *) a;
+	const struct inode *y = *(struct inode * const *) b;
+
+	return x->i_nr < y->i_nr ? -1 : x->i_nr > y->i_nr;
+}
+
+/* write back the inodes of sb queued by testfs_sync_inode. they are
+ * sorted by number, so the inodes sharing an inode block are next to each
+ * other, and each inode block is read and written once */
+void testfs_flush_inodes(struct super_block *sb) {
+	char block[BLOCK_SIZE(sb)];
+	struct inode *in, *next, **v;
+	int nr = 0, i, j;
+
+	list_for_each_entry(in, &inode_dirty, dirty) {
+		if (in->sb == sb)
+			nr++;
+	}
+	if (nr == 0)
+		return;
+	v = malloc(nr * sizeof(struct inode *));
+	if (!v) {
+		EXIT("malloc");
+	}
+	i = 0;
+	list_for_each_entry_safe(in, next, &inode_dirty, dirty) {
+		if (in->sb == sb) {
+			list_del(&in->dirty);
+			v[i++] = in;
+		}
+	}
+	qsort(v, nr, sizeof(struct inode *), testfs_inode_cmp);
+	for (i = 0; i < nr; i = j) {
+		int block_nr = testfs_inode_to_block_nr(v[i]);
+
+		read_blocks(sb, block, block_nr, 1);
+		for (j = i; j < nr && testfs_inode_to_block_nr(v[j]) == block_nr;
+				j++) {
+			memcpy(block + testfs_inode_to_block_offset(v[j]),
+					&v[j]->in, sizeof(struct dinode));
+		}
+		write_blocks(sb, block, block_nr, 1);
+	}
+	for (i = 0; i < nr; i++) {
+		v[i]->i_flags &= ~I_FLAGS_QUEUED;
+		testfs_put_inode(v[i]);
+	}
+	free(v);
 }
 
 void testfs_put_inode(struct inode *in) {
 	assert((in->i_flags & I_FLAGS_DIRTY) == 0);
 	if (--in->i_count == 0) {
-		inode_hash_remove(in);
-		free(in);
+		/* the inode is clean, it can be dropped at any time */
+		list_add(&in->lru, &inode_lru);
+		inode_lru_len++;
+		inode_lru_shrink(inode_lru_capacity);
 	}
 }
 
@@ -263,9 +877,11 @@ testfs_inode_get_sb(struct inode *in) {
 
 /* returns negative value on error */
 int testfs_create_inode(struct super_block *sb, inode_type type,
-		struct inode **inp) {
+		struct inode *dir, struct inode **inp) {
 	struct inode *in;
-	int inode_nr = testfs_get_inode_freemap(sb);
+	// the new inode goes into the group of its directory
+	int inode_nr = testfs_get_inode_freemap(sb,
+			dir ? testfs_inode_group(sb, dir->i_nr) : 0);
 
 	if (inode_nr < 0) {
 		return inode_nr;
@@ -274,6 +890,10 @@ int testfs_create_inode(struct super_block *sb, inode_type type,
 	// call will lead to creation of a new inode
 	in = testfs_get_inode(sb, inode_nr);
 	in->in.i_type = type;
+	if (sb->extent_inodes) {
+		assert(BLOCK_SIZE(sb) >= EXTENT_MIN_BLOCK_SIZE);
+		in->in.i_ext_header = I_EXT_MAGIC;
+	}
 	in->i_flags |= I_FLAGS_DIRTY;
 	*inp = in;
 	return 0;
@@ -289,43 +909,94 @@ void testfs_remove_inode(struct inode *in) {
 	testfs_put_inode(in);
 }
 
+/* max nr of blocks mapped and submitted together by testfs_read_data */
+#define READ_BATCH 64
+
+/* upper bound of sb->ra_window */
+#define RA_MAX_WINDOW 64
+
+/* called after reading logical blocks [s_block_nr, e_block_nr) of in.
+ * a read that continues in the block where the previous one ended, or in
+ * the next block, is sequential and prefetches the following
+ * sb->ra_window blocks of the inode into the buffer cache in one batch.
+ * a new window is started when the reader gets within half a window of
+ * the end of the current one. */
+static void testfs_readahead(struct inode *in, int s_block_nr,
+		int e_block_nr) {
+	struct block_vec vec[RA_MAX_WINDOW];
+	int window = MIN(in->sb->ra_window, RA_MAX_WINDOW);
+	int seq = (s_block_nr == in->i_ra_next ||
+			s_block_nr + 1 == in->i_ra_next);
+	int start, end;
+
+	in->i_ra_next = e_block_nr;
+	if (!seq) {
+		in->i_ra_end = e_block_nr;
+		return;
+	}
+	if (window == 0 || in->i_ra_end - e_block_nr >= window / 2)
+		return;
+	start = MAX(e_block_nr, in->i_ra_end);
+	end = MIN(e_block_nr + window,
+			DIVROUNDUP(in->in.i_size, BLOCK_SIZE(in->sb)));
+	if (start >= end)
+		return;
+	prefetch_blocks(in->sb, vec, testfs_bmap_range(in, start, end - start,
+			vec));
+	in->i_ra_end = end;
+}
+
 /* read data from inode in, from start to start+size, into buf[size].
+ * the blocks are mapped first and then read with one vectored request,
+ * so adjacent blocks reach the device as a single transfer. blocks that
+ * are covered entirely are read straight into buf, the partial first and
+ * last blocks go through a bounce buffer. sequential reads trigger
+ * readahead.
  * return 0 on success.
  * return negative value on error. */
 int testfs_read_data(struct inode *in, int start, char *buf, const int size) {
-	char block[BLOCK_SIZE];
-	int b_offset = start % BLOCK_SIZE; /* src offset in block for copy */
-	int buf_offset = 0; /* dst offset in buf for copy */
-	int done = 0;
+	char head[BLOCK_SIZE(in->sb)], tail[BLOCK_SIZE(in->sb)];
+	struct block_vec vec[READ_BATCH];
+	int end = start + size;
+	int log_block_nr = start / BLOCK_SIZE(in->sb);
+	int e_block_nr = DIVROUNDUP(end, BLOCK_SIZE(in->sb));
 
 	assert(buf);
 	// start offset to read from and size of data to read from the inode
 	// should be less than the actual zie of the inode
 	assert((start + size) <= in->in.i_size);
-	do {
-		int block_nr = (start + buf_offset) / BLOCK_SIZE;
-		int copy_size;
+	while (log_block_nr < e_block_nr) {
+		int s_block_nr = log_block_nr;
+		int cnt = MIN(e_block_nr - log_block_nr, READ_BATCH);
+		int mapped, i;
 
-		// reads inode block to block buffer. returns 
-		// physical block number 
-		block_nr = testfs_get_block(in, block, block_nr);
-		if (block_nr < 0)
-			return block_nr;
-		assert(block_nr > 0);
-		if ((size - buf_offset) <= (BLOCK_SIZE - b_offset)) {
-			// reading the last block from inode file
-			copy_size = size - buf_offset;
-			done = 1;
-		} else {
-			// reading the first/intermediate block from inode file.
-			// at first b_offset may be a non BLOCK_SIZE aligned value
-			// later it becomes an aligned value (b_offset = 0)
-			copy_size = BLOCK_SIZE - b_offset;
+		// the blocks of the batch are all mapped, as the file has no
+		// holes
+		mapped = testfs_bmap_range(in, s_block_nr, cnt, vec);
+		assert(mapped == cnt);
+		for (i = 0; i < cnt; i++, log_block_nr++) {
+			int b_start = log_block_nr * BLOCK_SIZE(in->sb);
+
+			if (b_start < start)
+				vec[i].bv_data = head;
+			else if (b_start + BLOCK_SIZE(in->sb) > end)
+				vec[i].bv_data = tail;
+			else
+				vec[i].bv_data = buf + (b_start - start);
 		}
-		memcpy(buf + buf_offset, block + b_offset, copy_size);
-		buf_offset += copy_size;
-		b_offset = 0;
-	} while (!done);
+		read_blocks_vec(in->sb, vec, cnt);
+		for (i = 0; i < cnt; i++) {
+			int b_start = (s_block_nr + i) * BLOCK_SIZE(in->sb);
+			int from = MAX(start, b_start);
+			int to = MIN(end, b_start + BLOCK_SIZE(in->sb));
+
+			if (vec[i].bv_data != head && vec[i].bv_data != tail)
+				continue;
+			memcpy(buf + (from - start), vec[i].bv_data + (from - b_start),
+					to - from);
+		}
+	}
+	testfs_readahead(in, start / BLOCK_SIZE(in->sb), e_block_nr);
 	return 0;
 }
 
@@ -334,59 +1005,110 @@ int testfs_read_data(struct inode *in, int start, char *buf, const int size) {
  * return negative value on error. */
 /* TODO: on error, deallocate blocks */
 int testfs_write_data(struct inode *in, int start, char *buf, const int size) {
-	char block[BLOCK_SIZE];
-	int b_offset = start % BLOCK_SIZE; /* dst offset in block for copy */
+	char block[BLOCK_SIZE(in->sb)];
+	int b_offset = start % BLOCK_SIZE(in->sb); /* dst offset in block for copy */
 	int buf_offset = 0; /* src offset in buf for copy */
 	int done = 0;
+	struct block_rsv rsv = { 0, 0, 0 };
+	struct map_run run = { 0, 0, 0, 0 };
+	int e_block_nr = DIVROUNDUP(start + size, BLOCK_SIZE(in->sb));
 
 	assert(buf);
 	assert(start <= in->in.i_size);
+	/* reserve for all blocks of the write, and the indirect block. the
+	 * blocks that turn out to exist already are released at the end. */
+	rsv.want = e_block_nr - start / BLOCK_SIZE(in->sb);
+	if (!I_HAS_EXTENTS(&in->in) && e_block_nr > NR_DIRECT_BLOCKS &&
+			in->in.i_indirect == 0)
+		rsv.want++;
 	do {
-		int block_nr = (start + buf_offset) / BLOCK_SIZE;
+		int block_nr = (start + buf_offset) / BLOCK_SIZE(in->sb);
 		int copy_size;
 		int csum;
 
-		block_nr = testfs_allocate_block(in, block, block_nr);
+		if (I_HAS_EXTENTS(&in->in))
+			block_nr = testfs_ext_allocate_block(in, block, block_nr,
+					e_block_nr - block_nr, &rsv, &run);
+		else
+			block_nr = testfs_allocate_block(in, block, block_nr, &rsv);
 		if (block_nr < 0) {
 			int orig_size = in->in.i_size;
+			if (rsv.count > 0)
+				testfs_release_blocks(in->sb, rsv.next, rsv.count);
 			in->in.i_size = MAX(orig_size, start + buf_offset);
 			in->i_flags |= I_FLAGS_DIRTY;
 			testfs_truncate_data(in, orig_size);
 			return block_nr;
 		}
 		assert(block_nr > 0);
-		if ((size - buf_offset) <= (BLOCK_SIZE - b_offset)) {
+		if ((size - buf_offset) <= (BLOCK_SIZE(in->sb) - b_offset)) {
 			copy_size = size - buf_offset;
 			done = 1;
 		} else {
-			copy_size = BLOCK_SIZE - b_offset;
+			copy_size = BLOCK_SIZE(in->sb) - b_offset;
 		}
 		memcpy(block + b_offset, buf + buf_offset, copy_size);
-		csum = testfs_calculate_csum(block, BLOCK_SIZE);
+		csum = testfs_calculate_csum(block, BLOCK_SIZE(in->sb));
 		write_blocks(in->sb, block, block_nr, 1);
 		testfs_put_csum(in->sb, block_nr, csum);
 		buf_offset += copy_size;
 		b_offset = 0;
 	} while (!done);
+	if (rsv.count > 0)
+		testfs_release_blocks(in->sb, rsv.next, rsv.count);
 	in->in.i_size = MAX(in->in.i_size, start + size);
 	in->i_flags |= I_FLAGS_DIRTY;
 	return 0;
 }
 
+/* blocks freed by testfs_truncate_data, gathered into runs of contiguous
+ * blocks that are freed together */
+struct free_run {
+	int start;
+	int nr;
+};
+
+static void testfs_free_run_flush(struct super_block *sb,
+		struct free_run *run) {
+	if (run->nr > 0)
+		testfs_free_blocks(sb, run->start, run->nr);
+	run->nr = 0;
+}
+
+static void testfs_free_run_add(struct super_block *sb, struct free_run *run,
+		int block_nr) {
+	/* adjacent data blocks are in the same group */
+	if (run->nr > 0 && block_nr == run->start + run->nr) {
+		run->nr++;
+		return;
+	}
+	testfs_free_run_flush(sb, run);
+	run->start = block_nr;
+	run->nr = 1;
+}
+
 void testfs_truncate_data(struct inode *in, const int size) {
+	struct free_run run = { 0, 0 };
 	int i;
 	int s_block_nr;
 	int e_block_nr;
 
 	if (in->in.i_size <= size)
 		return;
-	s_block_nr = DIVROUNDUP(size, BLOCK_SIZE);
-	e_block_nr = DIVROUNDUP(in->in.i_size, BLOCK_SIZE);
+	s_block_nr = DIVROUNDUP(size, BLOCK_SIZE(in->sb));
+	e_block_nr = DIVROUNDUP(in->in.i_size, BLOCK_SIZE(in->sb));
+
+	if (I_HAS_EXTENTS(&in->in)) {
+		testfs_ext_truncate(in, s_block_nr);
+		in->in.i_size = size;
+		in->i_flags |= I_FLAGS_DIRTY;
+		return;
+	}
 
 	/* remove direct blocks */
 	for (i = s_block_nr; i < e_block_nr && i < NR_DIRECT_BLOCKS; i++) {
 		assert(in->in.i_block_nr[i] > 0);
-		testfs_free_block(in->sb, in->in.i_block_nr[i]);
+		testfs_free_run_add(in->sb, &run, in->in.i_block_nr[i]);
 		in->in.i_block_nr[i] = 0;
 		in->i_flags |= I_FLAGS_DIRTY;
 	}
@@ -395,17 +1117,18 @@ void testfs_truncate_data(struct inode *in, const int size) {
 	e_block_nr -= NR_DIRECT_BLOCKS;
 
 	if (e_block_nr > 0) { /* remove indirect blocks */
-		char block[BLOCK_SIZE];
+		char block[BLOCK_SIZE(in->sb)];
 		assert(in->in.i_indirect > 0);
 		read_blocks(in->sb, block, in->in.i_indirect, 1);
-		for (i = s_block_nr; i < e_block_nr && i < NR_INDIRECT_BLOCKS; i++) {
+		for (i = s_block_nr; i < e_block_nr &&
+				i < NR_INDIRECT_BLOCKS(in->sb); i++) {
 			int block_nr = ((int *) block)[i];
 			assert(block_nr > 0);
-			testfs_free_block(in->sb, block_nr);
+			testfs_free_run_add(in->sb, &run, block_nr);
 			((int *) block)[i] = 0;
 		}
 		if (s_block_nr == 0) {
-			testfs_free_block(in->sb, in->in.i_indirect);
+			testfs_free_run_add(in->sb, &run, in->in.i_indirect);
 			in->in.i_indirect = 0;
 			in->i_flags |= I_FLAGS_DIRTY;
 		} else {
@@ -414,40 +1137,76 @@ void testfs_truncate_data(struct inode *in, const int size) {
 	} else {
 		assert(in->in.i_indirect == 0);
 	}
+	testfs_free_run_flush(in->sb, &run);
 	in->in.i_size = size;
 	in->i_flags |= I_FLAGS_DIRTY;
 }
 
+/* same as testfs_check_inode, for extent inodes */
+static int testfs_ext_check(struct super_block *sb, struct bitmap *b_freemap,
+		struct inode *in) {
+	struct dextent ext[NR_EXTENTS(sb)];
+	int nr = testfs_ext_load(in, ext);
+	int size = 0;
+	int i, j;
+
+	if (in->in.i_ext_block) {
+		assert(nr > 1);
+		assert(testfs_data_block_index(sb, in->in.i_ext_block) >= 0);
+		bitmap_mark(b_freemap,
+				testfs_data_block_index(sb, in->in.i_ext_block));
+	}
+	for (i = 0; i < nr; i++) {
+		int index = testfs_data_block_index(sb, ext[i].e_physical);
+
+		assert(ext[i].e_logical == size / BLOCK_SIZE(sb));
+		assert(ext[i].e_len > 0);
+		assert(index >= 0);
+		for (j = 0; j < ext[i].e_len; j++) {
+			/* verify checksum */
+			testfs_verify_csum(sb, ext[i].e_physical + j);
+		}
+		bitmap_mark_range(b_freemap, index, ext[i].e_len);
+		size += ext[i].e_len * BLOCK_SIZE(sb);
+	}
+	return size;
+}
+
 int testfs_check_inode(struct super_block *sb, struct bitmap *b_freemap,
 		struct inode *in) {
 	int size = 0;
 	int i;
-	char block[BLOCK_SIZE];
+	char block[BLOCK_SIZE(sb)];
 
+	if (I_HAS_EXTENTS(&in->in))
+		return testfs_ext_check(sb, b_freemap, in);
 	for (i = 0; i < NR_DIRECT_BLOCKS; i++) {
 		int block_nr = in->in.i_block_nr[i];
 		if (block_nr == 0)
 			return size;
-		size += BLOCK_SIZE;
+		size += BLOCK_SIZE(sb);
 
 		/* verify checksum */
 		testfs_verify_csum(sb, block_nr);
 
 		/* mark block freemap */
-		block_nr -= sb->sb.data_blocks_start;
+		block_nr = testfs_data_block_index(sb, block_nr);
+		assert(block_nr >= 0);
 		bitmap_mark(b_freemap, block_nr);
 	}
 	if (!in->in.i_indirect) {
 		return size;
 	}
-	bitmap_mark(b_freemap, in->in.i_indirect - sb->sb.data_blocks_start);
+	assert(testfs_data_block_index(sb, in->in.i_indirect) >= 0);
+	bitmap_mark(b_freemap, testfs_data_block_index(sb, in->in.i_indirect));
 	read_blocks(in->sb, block, in->in.i_indirect, 1);
-	for (i = 0; i < NR_INDIRECT_BLOCKS; i++) {
+	for (i = 0; i < NR_INDIRECT_BLOCKS(sb); i++) {
 		int block_nr = ((int *) block)[i];
 		if (block_nr == 0)
 			return size;
-		size += BLOCK_SIZE;
-		block_nr -= sb->sb.data_blocks_start;
+		size += BLOCK_SIZE(sb);
+		block_nr = testfs_data_block_index(sb, block_nr);
+		assert(block_nr >= 0);
 		bitmap_mark(b_freemap, block_nr);
 	}
 	return size;
@@ -7,7 +7,27 @@
 typedef enum {I_NONE, I_FILE, I_DIR} inode_type;
 
 #define NR_DIRECT_BLOCKS 4
-#define NR_INDIRECT_BLOCKS (BLOCK_SIZE/sizeof(int))
+#define NR_INDIRECT_BLOCKS(sb) (BLOCK_SIZE(sb)/sizeof(int))
+
+/*
+ * An inode maps its logical blocks to physical blocks in one of two
+ * formats, recorded in the inode:
+ *
+ * - block pointers: NR_DIRECT_BLOCKS direct pointers and one indirect
+ *   block of pointers.
+ * - extents: runs of contiguous blocks. The first extent is kept in the
+ *   dinode, the others in an overflow block, sorted by logical block.
+ *   Extent inodes are told apart by i_ext_header, which overlays
+ *   i_block_nr[0] and is negative, so it is never a block pointer.
+ *
+ * Files have no holes, the blocks of a file are mapped from logical block
+ * 0 to the end of the file.
+ */
+struct dextent {
+        int e_logical;                          /* first logical block */
+        int e_physical;                         /* first physical block */
+        int e_len;                              /* nr of blocks */
+};
 
 // dinode - inode maintained on disk
 
@@ -15,23 +35,60 @@ struct dinode {
         inode_type i_type;                      /* 0x00 */
         int i_size;                             /* 0x04 */
         int i_mod_time;                         /* 0x08 */
-        int i_block_nr[NR_DIRECT_BLOCKS];       /* 0x0C */
-        int i_indirect;                         /* 0x1C */
+        union {
+                struct {        /* block pointers */
+                        int i_block_nr[NR_DIRECT_BLOCKS];       /* 0x0C */
+                        int i_indirect;                         /* 0x1C */
+                };
+                struct {        /* extents */
+                        int i_ext_header;                       /* 0x0C */
+                        struct dextent i_ext;                   /* 0x10 */
+                        int i_ext_block;                        /* 0x1C */
+                };
+        };
 };
 
-#define INODES_PER_BLOCK (BLOCK_SIZE/(sizeof(struct dinode)))
+#define INODES_PER_BLOCK(sb) (BLOCK_SIZE(sb)/(sizeof(struct dinode)))
+
+/* i_ext_header is I_EXT_MAGIC plus the nr of extents */
+#define I_EXT_MAGIC     ((int) 0xEF000000)
+#define I_EXT_NR_MASK   0x00FFFFFF
+#define I_HAS_EXTENTS(din) \
+        (((din)->i_ext_header & ~I_EXT_NR_MASK) == I_EXT_MAGIC)
+
+/* max nr of extents of an inode, in the dinode and the overflow block */
+#define NR_EXTENTS(sb) (1 + BLOCK_SIZE(sb)/sizeof(struct dextent))
+
+/* smallest block size at which new inodes may use extents, below it
+ * too few extents fit in an inode (6 at 64 bytes) */
+#define EXTENT_MIN_BLOCK_SIZE 1024
+
+/* default nr of unreferenced inodes kept in memory */
+#define INODE_CACHE_DEFAULT 64
+
+/* struct inodes come from slabs, a hit reuses a freed inode, a miss
+ * allocates a new slab */
+struct inode_slab_stats {
+        unsigned long slabs;
+        unsigned long in_use;
+        unsigned long hits;
+        unsigned long misses;
+};
 
 void inode_hash_init(void);
 void inode_hash_destroy(void);
+void inode_cache_resize(int capacity);
+void inode_slab_get_stats(struct inode_slab_stats *stats);
 struct inode *testfs_get_inode(struct super_block *sb, int inode_nr);
 void testfs_sync_inode(struct inode *in);
+void testfs_flush_inodes(struct super_block *sb);
 void testfs_put_inode(struct inode *in);
 int testfs_inode_get_size(struct inode *in);
 inode_type testfs_inode_get_type(struct inode *in);
 int testfs_inode_get_nr(struct inode *in);
 struct super_block *testfs_inode_get_sb(struct inode *in);
 int testfs_create_inode(struct super_block *sb, inode_type type,
-                        struct inode **inp);
+                        struct inode *dir, struct inode **inp);
 void testfs_remove_inode(struct inode *in);
 int testfs_read_data(struct inode *in, int start, char *buf, const int size);
 int testfs_write_data(struct inode *in, int start, char *name, const int size);
@@ -0,0 +1,96 @@
+/*
+ * Block I/O submission queue.
+ * See ioq.h for more information.
+ */
+
+#include <sys/uio.h>
+#include <assert.h>
+#include "testfs.h"
+#include "ioq.h"
+#include "dev.h"
+
+void ioq_init(struct ioq *q, struct block_dev *dev, int block_size) {
+	q->dev = dev;
+	q->block_size = block_size;
+	q->cnt = 0;
+	q->size = 0;
+	q->reqs = NULL;
+	q->iov = NULL;
+	q->runs = NULL;
+}
+
+void ioq_add(struct ioq *q, int nr, char *data) {
+	if (q->cnt == q->size) {
+		int size = q->size ? q->size * 2 : 16;
+		struct block_vec *reqs;
+		struct iovec *iov;
+		struct dev_req *runs;
+
+		reqs = realloc(q->reqs, size * sizeof(struct block_vec));
+		if (reqs == NULL) {
+			EXIT("realloc");
+		}
+		q->reqs = reqs;
+		iov = realloc(q->iov, size * sizeof(struct iovec));
+		if (iov == NULL) {
+			EXIT("realloc");
+		}
+		q->iov = iov;
+		runs = realloc(q->runs, size * sizeof(struct dev_req));
+		if (runs == NULL) {
+			EXIT("realloc");
+		}
+		q->runs = runs;
+		q->size = size;
+	}
+	q->reqs[q->cnt].bv_nr = nr;
+	q->reqs[q->cnt].bv_data = data;
+	q->cnt++;
+}
+
+static int ioq_cmp(const void *a, const void *b) {
+	const struct block_vec *x = a, *y = b;
+
+	return (x->bv_nr > y->bv_nr) - (x->bv_nr < y->bv_nr);
+}
+
+void ioq_submit(struct ioq *q, int write) {
+	int i, run, nr = 0;
+	int ret;
+
+	if (q->cnt == 0)
+		return;
+	qsort(q->reqs, q->cnt, sizeof(struct block_vec), ioq_cmp);
+	for (i = 0; i < q->cnt; i += run) {
+		struct dev_req *req = &q->runs[nr++];
+
+		for (run = 0; i + run < q->cnt && run < IOQ_MAX_IOV; run++) {
+			if (q->reqs[i + run].bv_nr != q->reqs[i].bv_nr + run)
+				break;
+			q->iov[i + run].iov_base = q->reqs[i + run].bv_data;
+			q->iov[i + run].iov_len = q->block_size;
+		}
+		req->write = write;
+		req->iov = q->iov + i;
+		req->iovcnt = run;
+		req->pos = (off_t) q->reqs[i].bv_nr * q->block_size;
+	}
+	if ((ret = testfs_dev_submit(q->dev, q->runs, nr)) < 0) {
+		errno = -ret;
+		EXIT(write ? "writev" : "readv");
+	}
+}
+
+void ioq_reset(struct ioq *q) {
+	q->cnt = 0;
+}
+
+void ioq_destroy(struct ioq *q) {
+	free(q->reqs);
+	free(q->iov);
+	free(q->runs);
+	q->reqs = NULL;
+	q->iov = NULL;
+	q->runs = NULL;
+	q->cnt = q->size = 0;
+}
@@ -0,0 +1,54 @@
+#ifndef _IOQ_H
+#define _IOQ_H
+
+/*
+ * Block I/O submission queue.
+ *
+ * Collects single block transfers and issues them as few device requests
+ * as possible: on submit, the queue is sorted by block number and every
+ * run of adjacent blocks becomes one vectored (preadv/pwritev style)
+ * request, whatever the addresses of the individual buffers. All the
+ * requests of a submit are handed to the device as one batch, so backends
+ * that can overlap them (io_uring) do.
+ *
+ * Functions:
+ *     ioq_init    - initialize an empty queue for dev, in blocks of
+ *                   block_size bytes.
+ *     ioq_add     - queue one block transfer to or from data.
+ *     ioq_submit  - issue all queued transfers. The queue keeps its
+ *                   (now sorted) entries until ioq_reset.
+ *     ioq_reset   - empty the queue.
+ *     ioq_destroy - free the queue memory.
+ *
+ * A block must not be queued twice in the same write batch.
+ */
+
+struct block_dev;
+struct iovec;
+struct dev_req;
+
+/* one block of a scatter/gather transfer */
+struct block_vec {
+        int bv_nr;                      /* block number */
+        char *bv_data;                  /* one block buffer */
+};
+
+struct ioq {
+        struct block_dev *dev;
+        int block_size;
+        int cnt;
+        int size;
+        struct block_vec *reqs;
+        struct iovec *iov;              /* one per queued block */
+        struct dev_req *runs;           /* one per run of adjacent blocks */
+};
+
+#define IOQ_MAX_IOV 256                 /* max blocks per device request */
+
+void ioq_init(struct ioq *q, struct block_dev *dev, int block_size);
+void ioq_add(struct ioq *q, int nr, char *data);
+void ioq_submit(struct ioq *q, int write);
+void ioq_reset(struct ioq *q);
+void ioq_destroy(struct ioq *q);
+
+#endif /* _IOQ_H */
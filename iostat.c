@@ -0,0 +1,185 @@
+/*
+ * Block I/O statistics.
+ * See iostat.h for more information.
+ */
+
+#include <time.h>
+#include "testfs.h"
+#include "super.h"
+#include "ioq.h"
+#include "iostat.h"
+#include "group.h"
+
+static const char *iostat_region_names[IOSTAT_NR_REGIONS] = {
+	"super", "inode freemap", "block freemap", "csum table",
+	"inode blocks", "data blocks",
+};
+
+static const char *iostat_op_names[IOSTAT_NR_OPS] = { "read", "write" };
+
+unsigned long long iostat_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* block 0 is the super block even before sb->sb has been read, the
+ * group descriptors count as part of it */
+static enum iostat_region iostat_region(struct super_block *sb, int nr) {
+	struct dgroup_desc *gd;
+	int g;
+
+	if (nr < SUPER_BLOCK_SIZE || !sb->groups)
+		return IOSTAT_SUPER;
+	g = testfs_block_group(sb, nr);
+	if (g < 0)
+		return IOSTAT_SUPER;
+	gd = &sb->groups[g];
+	if (nr >= gd->data_blocks_start)
+		return IOSTAT_DATA_BLOCKS;
+	if (nr >= gd->inode_blocks_start)
+		return IOSTAT_INODE_BLOCKS;
+	if (nr >= gd->csum_table_start)
+		return IOSTAT_CSUM_TABLE;
+	if (nr >= gd->block_freemap_start)
+		return IOSTAT_BLOCK_FREEMAP;
+	return IOSTAT_INODE_FREEMAP;
+}
+
+/* first block after the region r that block nr is in */
+static int iostat_region_end(struct super_block *sb, enum iostat_region r,
+		int nr) {
+	struct dgroup_desc *gd;
+	int g;
+
+	if (!sb->groups)
+		return -1;
+	if (r == IOSTAT_SUPER)
+		return sb->groups[0].inode_freemap_start;
+	g = testfs_block_group(sb, nr);
+	gd = &sb->groups[g];
+	switch (r) {
+	case IOSTAT_INODE_FREEMAP:
+		return gd->block_freemap_start;
+	case IOSTAT_BLOCK_FREEMAP:
+		return gd->csum_table_start;
+	case IOSTAT_CSUM_TABLE:
+		return gd->inode_blocks_start;
+	case IOSTAT_INODE_BLOCKS:
+		return gd->data_blocks_start;
+	default:
+		/* the data region of the last group is unbounded */
+		if (g + 1 < sb->geo.nr_groups)
+			return sb->groups[g + 1].inode_freemap_start;
+		return -1;
+	}
+}
+
+static void iostat_time(struct iostat_counter *c, unsigned long long t0) {
+	unsigned long long ns = iostat_now() - t0;
+	unsigned long long us = ns / 1000;
+	int b = 0;
+
+	while (us && b < IOSTAT_NR_BUCKETS - 1) {
+		us >>= 1;
+		b++;
+	}
+	c->calls++;
+	c->ns += ns;
+	c->hist[b]++;
+}
+
+void iostat_account(struct super_block *sb, enum iostat_op op, int start,
+		int nr, unsigned long long t0) {
+	enum iostat_region r = iostat_region(sb, start);
+	int end = start + nr;
+
+	iostat_time(&sb->iostat.io[r][op], t0);
+	while (start < end) {
+		int rend = iostat_region_end(sb, r, start);
+		int n = (rend > start && rend < end) ? rend - start : end - start;
+
+		sb->iostat.io[r][op].blocks += n;
+		start += n;
+		r = iostat_region(sb, start);
+	}
+}
+
+void iostat_account_vec(struct super_block *sb, enum iostat_op op,
+		struct block_vec *vec, int cnt, unsigned long long t0) {
+	int i;
+
+	if (cnt == 0)
+		return;
+	iostat_time(&sb->iostat.io[iostat_region(sb, vec[0].bv_nr)][op], t0);
+	for (i = 0; i < cnt; i++) {
+		sb->iostat.io[iostat_region(sb, vec[i].bv_nr)][op].blocks++;
+	}
+}
+
+void iostat_account_flush(struct super_block *sb, unsigned long long t0) {
+	iostat_time(&sb->iostat.flush, t0);
+}
+
+void testfs_iostat_get(struct super_block *sb, struct iostat *st) {
+	*st = sb->iostat;
+}
+
+void testfs_iostat_reset(struct super_block *sb) {
+	bzero(&sb->iostat, sizeof(struct iostat));
+}
+
+static void iostat_print_hist(struct iostat_counter *c, FILE *out) {
+	int b;
+
+	fprintf(out, "    usec");
+	for (b = 0; b < IOSTAT_NR_BUCKETS; b++) {
+		if (c->hist[b] == 0)
+			continue;
+		if (b == IOSTAT_NR_BUCKETS - 1)
+			fprintf(out, " >=%lu:%lu", 1UL << (b - 1), c->hist[b]);
+		else
+			fprintf(out, " <%lu:%lu", 1UL << b, c->hist[b]);
+	}
+	fprintf(out, "\n");
+}
+
+void testfs_iostat_print(struct super_block *sb, FILE *out) {
+	struct iostat_counter *c;
+	int r, op;
+
+	fprintf(out, "%-14s %-5s %8s %8s %10s\n", "region", "op", "calls",
+			"blocks", "usec");
+	for (r = 0; r < IOSTAT_NR_REGIONS; r++) {
+		for (op = 0; op < IOSTAT_NR_OPS; op++) {
+			c = &sb->iostat.io[r][op];
+			if (c->calls == 0 && c->blocks == 0)
+				continue;
+			fprintf(out, "%-14s %-5s %8lu %8lu %10llu\n",
+					iostat_region_names[r], iostat_op_names[op],
+					c->calls, c->blocks, c->ns / 1000);
+			if (c->calls)
+				iostat_print_hist(c, out);
+		}
+	}
+	c = &sb->iostat.flush;
+	if (c->calls) {
+		fprintf(out, "%-14s %-5s %8lu %8s %10llu\n", "device", "flush",
+				c->calls, "-", c->ns / 1000);
+		iostat_print_hist(c, out);
+	}
+}
+
+/* iostat [reset] */
+int cmd_iostat(struct super_block *sb, struct context *c) {
+	if (c->nargs == 2 && strcmp(c->cmd[1], "reset") == 0) {
+		testfs_iostat_reset(sb);
+		return 0;
+	}
+	if (c->nargs != 1) {
+		return -EINVAL;
+	}
+	testfs_iostat_print(sb, stdout);
+	return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef _IOSTAT_H
+#define _IOSTAT_H
+
+#include <stdio.h>
+
+/*
+ * Block I/O statistics.
+ *
+ * block.c accounts every read_blocks/write_blocks style call against the
+ * on-disk region (see struct dsuper_block) it touches: number of calls,
+ * number of blocks and time spent, with a log2 latency histogram. Blocks
+ * are split between regions exactly; the call and its latency are
+ * charged to the region of its first block. flush_blocks is accounted
+ * separately.
+ *
+ * Functions:
+ *     testfs_iostat_get   - copy the counters of a mounted file system.
+ *     testfs_iostat_reset - clear the counters.
+ *     testfs_iostat_print - print the non-zero counters.
+ *     iostat_now          - monotonic time in nanoseconds.
+ *     iostat_account      - account a transfer of nr blocks from start.
+ *     iostat_account_vec  - account a scatter/gather transfer.
+ *     iostat_account_flush - account a flush.
+ */
+
+enum iostat_region {
+        IOSTAT_SUPER,
+        IOSTAT_INODE_FREEMAP,
+        IOSTAT_BLOCK_FREEMAP,
+        IOSTAT_CSUM_TABLE,
+        IOSTAT_INODE_BLOCKS,
+        IOSTAT_DATA_BLOCKS,
+        IOSTAT_NR_REGIONS
+};
+
+enum iostat_op {
+        IOSTAT_READ,
+        IOSTAT_WRITE,
+        IOSTAT_NR_OPS
+};
+
+/* bucket 0 counts latencies under 1us, bucket i under 2^i us. the last
+ * bucket also counts everything slower. */
+#define IOSTAT_NR_BUCKETS 16
+
+struct iostat_counter {
+        unsigned long calls;
+        unsigned long blocks;
+        unsigned long long ns;
+        unsigned long hist[IOSTAT_NR_BUCKETS];
+};
+
+struct iostat {
+        struct iostat_counter io[IOSTAT_NR_REGIONS][IOSTAT_NR_OPS];
+        struct iostat_counter flush;    /* blocks is unused */
+};
+
+struct super_block;
+struct block_vec;
+
+void testfs_iostat_get(struct super_block *sb, struct iostat *st);
+void testfs_iostat_reset(struct super_block *sb);
+void testfs_iostat_print(struct super_block *sb, FILE *out);
+
+unsigned long long iostat_now(void);
+void iostat_account(struct super_block *sb, enum iostat_op op, int start,
+                    int nr, unsigned long long t0);
+void iostat_account_vec(struct super_block *sb, enum iostat_op op,
+                        struct block_vec *vec, int cnt,
+                        unsigned long long t0);
+void iostat_account_flush(struct super_block *sb, unsigned long long t0);
+
+#endif /* _IOSTAT_H */
@@ -1,38 +1,162 @@
+#include <getopt.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <unistd.h>
 #include "testfs.h"
 #include "super.h"
 #include "inode.h"
 #include "dir.h"
+#include "dev.h"
 #include "common.h"
 
 static void
 usage(char *progname)
 {
-        fprintf(stdout, "Usage: %s rawfile\n", progname);
+        fprintf(stdout, "Usage: %s [-a bitmap|extent] [-b block_size] "
+                "[-i nr_inodes] [-n nr_data_blocks] [-g blocks_per_group] "
+                "[-s size[KMG] | -F] rawfile\n", progname);
+        fprintf(stdout, "  -a: data block allocator (default bitmap)\n");
+        fprintf(stdout, "  -s: size the file system to fill size bytes\n");
+        fprintf(stdout, "  -F: size the file system to fill the existing "
+                "rawfile\n");
+        fprintf(stdout, "without -i, -n, -g, -s and -F the file system has "
+                "the default geometry\n");
         exit(1);
 }
 
+/* parse a positive count, or exit */
+static int
+parse_count(char *progname, const char *arg)
+{
+        char *end;
+        long val = strtol(arg, &end, 0);
+
+        if (*end != '\0' || val <= 0 || val > INT_MAX) {
+                usage(progname);
+        }
+        return val;
+}
+
+/* parse a size in bytes with an optional K, M or G suffix, or exit */
+static off_t
+parse_size(char *progname, const char *arg)
+{
+        char *end;
+        long long val = strtoll(arg, &end, 0);
+
+        switch (*end) {
+        case 'G': case 'g':
+                val *= 1024;
+                /* fall through */
+        case 'M': case 'm':
+                val *= 1024;
+                /* fall through */
+        case 'K': case 'k':
+                val *= 1024;
+                end++;
+                break;
+        }
+        if (*end != '\0' || val <= 0) {
+                usage(progname);
+        }
+        return val;
+}
+
 int
 main(int argc, char *argv[])
 {
-        struct super_block *sb;
-        int ret;
+        struct block_dev *dev;
+        struct testfs_geometry geo;
+        int block_size = DEFAULT_BLOCK_SIZE;
+        int nr_inodes = 0, nr_data_blocks = 0, blocks_per_group = 0;
+        int fit = 0;
+        enum testfs_allocator allocator = TESTFS_ALLOC_BITMAP;
+        off_t size = 0;
+        int ret, c;
 
-        if (argc != 2) {
+        while ((c = getopt(argc, argv, "a:b:g:i:n:s:F")) != -1) {
+                switch (c) {
+                case 'a':
+                        if (strcmp(optarg, "bitmap") == 0) {
+                                allocator = TESTFS_ALLOC_BITMAP;
+                        } else if (strcmp(optarg, "extent") == 0) {
+                                allocator = TESTFS_ALLOC_EXTENT;
+                        } else {
+                                usage(argv[0]);
+                        }
+                        break;
+                case 'b':
+                        block_size = atoi(optarg);
+                        if (!testfs_block_size_valid(block_size)) {
+                                fprintf(stdout, "block size must be a power "
+                                        "of two from %d to %d\n",
+                                        MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+                                exit(1);
+                        }
+                        break;
+                case 'g':
+                        blocks_per_group = parse_count(argv[0], optarg);
+                        break;
+                case 'i':
+                        nr_inodes = parse_count(argv[0], optarg);
+                        break;
+                case 'n':
+                        nr_data_blocks = parse_count(argv[0], optarg);
+                        break;
+                case 's':
+                        size = parse_size(argv[0], optarg);
+                        break;
+                case 'F':
+                        fit = 1;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (argc - optind != 1 || (size && fit) ||
+            ((size || fit) && nr_data_blocks)) {
                 usage(argv[0]);
         }
-		
-        sb = testfs_make_super_block(argv[1]);
-        testfs_make_inode_freemap(sb);
-        testfs_make_block_freemap(sb);
-        testfs_make_csum_table(sb);
-        testfs_make_inode_blocks(sb);
-        testfs_close_super_block(sb);
+        if (fit) {
+                struct stat st;
+
+                /* the file is truncated when it is opened below */
+                if (stat(argv[optind], &st) < 0) {
+                        EXIT(argv[optind]);
+                }
+                size = st.st_size;
+        }
 
-        ret = testfs_init_super_block(argv[1], 0, &sb);
-        if (ret) {
-                EXIT("testfs_init_super_block");
+        testfs_default_geometry(block_size, &geo);
+        ret = 0;
+        if (size) {
+                geo.nr_inodes = nr_inodes;
+                geo.blocks_per_group = blocks_per_group;
+                ret = testfs_fit_geometry(&geo, size);
+        } else if (nr_inodes || nr_data_blocks || blocks_per_group) {
+                geo.blocks_per_group = blocks_per_group;
+                if (nr_inodes)
+                        geo.nr_inodes = nr_inodes;
+                if (nr_data_blocks)
+                        geo.nr_data_blocks = nr_data_blocks;
+                ret = testfs_layout_geometry(&geo);
+        }
+        if (ret < 0) {
+                errno = -ret;
+                EXIT("geometry");
+        }
+        geo.allocator = allocator;
+
+        ret = testfs_dev_open_file(argv[optind], BDEV_CREATE, &dev);
+        if (ret < 0) {
+                errno = -ret;
+                EXIT(argv[optind]);
+        }
+        testfs_make_fs(dev, &geo);
+        /* the data blocks are written on demand, make the image as large
+         * as it was sized for */
+        if (size && truncate(argv[optind], size) < 0) {
+                EXIT(argv[optind]);
         }
-        testfs_make_root_dir(sb);
-        testfs_close_super_block(sb);
         return 0;
 }
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include "testfs.h"
 #include "super.h"
 #include "inode.h"
@@ -5,123 +6,440 @@
 #include "block.h"
 #include "bitmap.h"
 #include "csum.h"
-#include <sys/types.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+#include "dev.h"
+#include "bcache.h"
+#include "group.h"
+#include "extent.h"
+
+/* block sizes are powers of two between MIN_BLOCK_SIZE and
+ * MAX_BLOCK_SIZE */
+int testfs_block_size_valid(int block_size) {
+	return block_size >= MIN_BLOCK_SIZE && block_size <= MAX_BLOCK_SIZE &&
+		(block_size & (block_size - 1)) == 0;
+}
+
+/* the default geometry: the fixed layout of images created before the
+ * geometry was recorded in the super block, a single ungrouped group. */
+void testfs_default_geometry(int block_size, struct testfs_geometry *geo) {
+	geo->block_size = block_size;
+	geo->nr_inodes = NR_INODE_BLOCKS * (block_size / sizeof(struct dinode));
+	geo->nr_data_blocks = NR_DATA_BLOCKS;
+	geo->nr_groups = 1;
+	geo->inodes_per_group = geo->nr_inodes;
+	geo->blocks_per_group = geo->nr_data_blocks;
+	geo->group_desc_size = 0;
+	geo->inode_freemap_size = INODE_FREEMAP_SIZE;
+	geo->block_freemap_size = BLOCK_FREEMAP_SIZE;
+	geo->csum_table_size = CSUM_TABLE_SIZE;
+	geo->nr_inode_blocks = NR_INODE_BLOCKS;
+	geo->allocator = TESTFS_ALLOC_BITMAP;
+}
+
+/* nr of blocks in an image with geometry geo */
+static long long testfs_geometry_nr_blocks(const struct testfs_geometry *geo) {
+	return (long long) SUPER_BLOCK_SIZE + geo->group_desc_size +
+		(long long) geo->nr_groups * (geo->inode_freemap_size +
+		geo->block_freemap_size + geo->csum_table_size +
+		geo->nr_inode_blocks) + geo->nr_data_blocks;
+}
+
+/* inodes per group are a multiple of this, so that the inodes of a group
+ * fill whole inode blocks and whole bytes of the inode freemap */
+static int testfs_inode_group_align(int block_size) {
+	return MAX(block_size / sizeof(struct dinode), BITS_PER_WORD);
+}
+
+/* data blocks per group are a multiple of this, so that their checksums
+ * fill whole blocks of the checksum table */
+static int testfs_block_group_align(int block_size) {
+	return block_size / sizeof(int);
+}
+
+/* size the per group regions of a grouped geometry */
+static void testfs_size_groups(struct testfs_geometry *geo) {
+	int bits = geo->block_size * BITS_PER_WORD;
+
+	geo->group_desc_size = DIVROUNDUP((long long) geo->nr_groups *
+			sizeof(struct dgroup_desc), geo->block_size);
+	geo->inode_freemap_size = DIVROUNDUP(geo->inodes_per_group, bits);
+	geo->block_freemap_size = DIVROUNDUP(geo->blocks_per_group, bits);
+	geo->csum_table_size = geo->blocks_per_group * sizeof(int) /
+		geo->block_size;
+	geo->nr_inode_blocks = geo->inodes_per_group /
+		(geo->block_size / sizeof(struct dinode));
+}
+
+/* split the counts of geo into block groups and size their regions. the
+ * groups have geo->blocks_per_group data blocks, or one block freemap
+ * block's worth if it is 0. the nr of inodes is rounded up to fill the
+ * groups. returns negative value on error */
+int testfs_layout_geometry(struct testfs_geometry *geo) {
+	int bs = geo->block_size;
+	long long nr_inodes;
+
+	if (!testfs_block_size_valid(bs) || geo->nr_inodes <= 0
+			|| geo->nr_data_blocks <= 0 || geo->blocks_per_group < 0)
+		return -EINVAL;
+	if (geo->blocks_per_group == 0)
+		geo->blocks_per_group = bs * BITS_PER_WORD;
+	if (geo->blocks_per_group % testfs_block_group_align(bs))
+		return -EINVAL;
+	/* a single group needs no more blocks than there are */
+	geo->blocks_per_group = MIN(geo->blocks_per_group,
+			ROUNDUP(geo->nr_data_blocks, testfs_block_group_align(bs)));
+	geo->nr_groups = DIVROUNDUP(geo->nr_data_blocks, geo->blocks_per_group);
+	geo->inodes_per_group = ROUNDUP(DIVROUNDUP(geo->nr_inodes,
+			geo->nr_groups), testfs_inode_group_align(bs));
+	nr_inodes = (long long) geo->inodes_per_group * geo->nr_groups;
+	if (nr_inodes > INT_MAX)
+		return -EFBIG;
+	geo->nr_inodes = nr_inodes;
+	testfs_size_groups(geo);
+	if (testfs_geometry_nr_blocks(geo) > INT_MAX)
+		return -EFBIG;
+	return 0;
+}
 
+/* pick the counts of geo so that the image fills size bytes. if
+ * geo->nr_inodes is positive it is kept, otherwise there is one inode per
+ * INODE_RATIO data blocks. returns negative value on error */
+int testfs_fit_geometry(struct testfs_geometry *geo, off_t size) {
+	long long nr_blocks = size / geo->block_size;
+	int nr_inodes = geo->nr_inodes;
+	long long nr_data;
+	int ret;
+
+	nr_blocks = MIN(nr_blocks, INT_MAX);
+	nr_data = nr_blocks;
+	for (;;) {
+		long long total;
+
+		if (nr_data <= 0)
+			return -ENOSPC;
+		geo->nr_data_blocks = nr_data;
+		geo->nr_inodes = nr_inodes > 0 ? nr_inodes :
+			MAX(nr_data / INODE_RATIO, 1);
+		ret = testfs_layout_geometry(geo);
+		if (ret < 0)
+			return ret;
+		total = testfs_geometry_nr_blocks(geo);
+		if (total <= nr_blocks)
+			return 0;
+		/* the metadata regions shrink with the counts, so this
+		 * converges */
+		nr_data -= total - nr_blocks;
+	}
+}
+
+/* read the geometry of an ungrouped image from the start fields of its
+ * dsuper_block. returns negative value on error */
+static int testfs_init_ungrouped(struct super_block *sb) {
+	struct dsuper_block *dsb = &sb->sb;
+	struct testfs_geometry *geo = &sb->geo;
+	long long max_inodes, max_data_blocks;
+
+	geo->inode_freemap_size = dsb->block_freemap_start -
+			dsb->inode_freemap_start;
+	geo->block_freemap_size = dsb->csum_table_start - dsb->block_freemap_start;
+	geo->csum_table_size = dsb->inode_blocks_start - dsb->csum_table_start;
+	geo->nr_inode_blocks = dsb->data_blocks_start - dsb->inode_blocks_start;
+	if (dsb->inode_freemap_start != SUPER_BLOCK_SIZE ||
+			geo->inode_freemap_size <= 0 || geo->block_freemap_size <= 0 ||
+			geo->csum_table_size <= 0 || geo->nr_inode_blocks <= 0)
+		return -EINVAL;
+
+	/* the counts are limited by the regions that hold per inode and per
+	 * block state */
+	max_inodes = MIN((long long) geo->inode_freemap_size *
+			geo->block_size * BITS_PER_WORD,
+			(long long) geo->nr_inode_blocks * INODES_PER_BLOCK(sb));
+	max_data_blocks = MIN((long long) geo->block_freemap_size *
+			geo->block_size * BITS_PER_WORD,
+			(long long) geo->csum_table_size * geo->block_size /
+			sizeof(int));
+	if (dsb->nr_inodes == 0) {
+		/* old images use all of their regions */
+		geo->nr_inodes = max_inodes;
+		geo->nr_data_blocks = max_data_blocks;
+	} else {
+		geo->nr_inodes = dsb->nr_inodes;
+		geo->nr_data_blocks = dsb->nr_data_blocks;
+	}
+	if (geo->nr_inodes <= 0 || geo->nr_inodes > max_inodes ||
+			geo->nr_data_blocks <= 0 ||
+			geo->nr_data_blocks > max_data_blocks)
+		return -EINVAL;
+	geo->nr_groups = 1;
+	geo->inodes_per_group = geo->nr_inodes;
+	geo->blocks_per_group = geo->nr_data_blocks;
+	geo->group_desc_size = 0;
+	return 0;
+}
+
+/* read the geometry from the dsuper_block of sb and check it.
+ * returns negative value on error */
+static int testfs_init_geometry(struct super_block *sb) {
+	struct dsuper_block *dsb = &sb->sb;
+	struct testfs_geometry *geo = &sb->geo;
+	int bs;
+
+	bs = dsb->block_size ? dsb->block_size : DEFAULT_BLOCK_SIZE;
+	geo->block_size = bs;
+	if (!testfs_block_size_valid(bs))
+		return -EINVAL;
+	geo->allocator = dsb->allocator;
+	if (geo->allocator != TESTFS_ALLOC_BITMAP &&
+			geo->allocator != TESTFS_ALLOC_EXTENT)
+		return -EINVAL;
+	if (dsb->nr_groups == 0)
+		return testfs_init_ungrouped(sb);
+
+	geo->nr_inodes = dsb->nr_inodes;
+	geo->nr_data_blocks = dsb->nr_data_blocks;
+	geo->nr_groups = dsb->nr_groups;
+	geo->inodes_per_group = dsb->inodes_per_group;
+	geo->blocks_per_group = dsb->blocks_per_group;
+	if (geo->nr_groups < 0 || geo->inodes_per_group <= 0 ||
+			geo->inodes_per_group % testfs_inode_group_align(bs) ||
+			geo->blocks_per_group <= 0 ||
+			geo->blocks_per_group % testfs_block_group_align(bs) ||
+			(long long) geo->nr_groups * geo->inodes_per_group !=
+			geo->nr_inodes || geo->nr_data_blocks <= (long long)
+			(geo->nr_groups - 1) * geo->blocks_per_group ||
+			geo->nr_data_blocks > (long long) geo->nr_groups *
+			geo->blocks_per_group)
+		return -EINVAL;
+	testfs_size_groups(geo);
+	return 0;
+}
+
+/* mapped devices are accessed in place, everything else through a
+ * buffer cache. returns negative value on error */
+static int testfs_attach_dev(struct super_block *sb, struct block_dev *dev) {
+	sb->dev = dev;
+	sb->bcache = NULL;
+	testfs_iostat_reset(sb);
+	sb->ra_window = RA_DEFAULT_WINDOW;
+	sb->extent_inodes = 0;
+	if (dev->caps & BDEV_CAP_MAPPED)
+		return 0;
+	return bcache_create(dev, BLOCK_SIZE(sb), BCACHE_DEFAULT_NR_BUFS,
+			&sb->bcache);
+}
+
+/* takes over the caller's reference to dev */
 struct super_block *
-testfs_make_super_block(char *file) {
+testfs_make_super_block(struct block_dev *dev,
+		const struct testfs_geometry *geo) {
 	struct super_block *sb = calloc(1, sizeof(struct super_block));
 
 	if (!sb) {
 		EXIT("malloc");
 	}
-	if ((sb->dev = fopen(file, "w")) == NULL) {
-		EXIT(file);
+	assert(testfs_block_size_valid(geo->block_size));
+	sb->geo = *geo;
+	sb->sb.block_size = geo->block_size;
+	sb->sb.nr_inodes = geo->nr_inodes;
+	sb->sb.nr_data_blocks = geo->nr_data_blocks;
+	sb->sb.allocator = geo->allocator;
+	if (geo->group_desc_size > 0) {
+		sb->sb.nr_groups = geo->nr_groups;
+		sb->sb.inodes_per_group = geo->inodes_per_group;
+		sb->sb.blocks_per_group = geo->blocks_per_group;
+	}
+	if (testfs_attach_dev(sb, dev) < 0) {
+		EXIT("bcache_create");
+	}
+	if (testfs_make_groups(sb) < 0) {
+		EXIT("malloc");
 	}
-	sb->sb.inode_freemap_start = SUPER_BLOCK_SIZE;
-	sb->sb.block_freemap_start = sb->sb.inode_freemap_start +
-	INODE_FREEMAP_SIZE;
-	sb->sb.csum_table_start = sb->sb.block_freemap_start +
-	BLOCK_FREEMAP_SIZE;
-	sb->sb.inode_blocks_start = sb->sb.csum_table_start +
-	CSUM_TABLE_SIZE;
-	sb->sb.data_blocks_start = sb->sb.inode_blocks_start + NR_INODE_BLOCKS;
+	/* the start fields locate the first group */
+	sb->sb.inode_freemap_start = sb->groups[0].inode_freemap_start;
+	sb->sb.block_freemap_start = sb->groups[0].block_freemap_start;
+	sb->sb.csum_table_start = sb->groups[0].csum_table_start;
+	sb->sb.inode_blocks_start = sb->groups[0].inode_blocks_start;
+	sb->sb.data_blocks_start = sb->groups[0].data_blocks_start;
 	sb->sb.modification_time = 0;
+	sb->sb.nr_free_inodes = geo->nr_inodes;
+	sb->sb.nr_free_blocks = geo->nr_data_blocks;
 	testfs_write_super_block(sb);
 	inode_hash_init();
 	return sb;
 }
 
 void testfs_make_inode_freemap(struct super_block *sb) {
-	zero_blocks(sb, sb->sb.inode_freemap_start, INODE_FREEMAP_SIZE);
+	int g;
+
+	for (g = 0; g < sb->geo.nr_groups; g++)
+		zero_blocks(sb, sb->groups[g].inode_freemap_start,
+				sb->geo.inode_freemap_size);
 }
 
 void testfs_make_block_freemap(struct super_block *sb) {
-	zero_blocks(sb, sb->sb.block_freemap_start, BLOCK_FREEMAP_SIZE);
+	int g;
+
+	for (g = 0; g < sb->geo.nr_groups; g++)
+		zero_blocks(sb, sb->groups[g].block_freemap_start,
+				sb->geo.block_freemap_size);
 }
 
 void testfs_make_csum_table(struct super_block *sb) {
-	/* number of data blocks cannot exceed size of checksum table */
-	assert(MAX_NR_CSUMS > NR_DATA_BLOCKS);
-	zero_blocks(sb, sb->sb.csum_table_start, CSUM_TABLE_SIZE);
+	int g;
+
+	/* number of data blocks of a group cannot exceed size of its
+	 * checksum table */
+	assert(sb->geo.csum_table_size * BLOCK_SIZE(sb) / sizeof(int) >=
+			sb->geo.blocks_per_group);
+	for (g = 0; g < sb->geo.nr_groups; g++)
+		zero_blocks(sb, sb->groups[g].csum_table_start,
+				sb->geo.csum_table_size);
 }
 
 void testfs_make_inode_blocks(struct super_block *sb) {
+	int g;
+
 	/* dinodes should not span blocks */
-	assert((BLOCK_SIZE % sizeof(struct dinode)) == 0);
-	zero_blocks(sb, sb->sb.inode_blocks_start, NR_INODE_BLOCKS);
+	assert((BLOCK_SIZE(sb) % sizeof(struct dinode)) == 0);
+	for (g = 0; g < sb->geo.nr_groups; g++)
+		zero_blocks(sb, sb->groups[g].inode_blocks_start,
+				sb->geo.nr_inode_blocks);
+}
+
+/* the freemaps of an ungrouped image are as large as their region, so
+ * that whole blocks can be read into them */
+static int testfs_create_freemap(struct super_block *sb, u_int32_t nbits,
+		int region_size, struct bitmap **bp) {
+	if (sb->geo.group_desc_size > 0)
+		return bitmap_create(nbits, bp);
+	return bitmap_create_padded(nbits, region_size * BLOCK_SIZE(sb), bp);
+}
+
+/* build the tree of free extents from the block freemap.
+ * returns negative value on error */
+static int testfs_build_free_extents(struct super_block *sb) {
+	u_int32_t nr = sb->geo.nr_data_blocks;
+	u_int32_t start, end = 0;
+	int ret;
+
+	ret = extent_tree_create(&sb->free_extents);
+	if (ret < 0)
+		return ret;
+	while (bitmap_find_next_clear(sb->block_freemap, end, nr, &start) == 0) {
+		if (bitmap_find_next_set(sb->block_freemap, start, nr, &end) < 0)
+			end = nr;
+		ret = extent_tree_insert(sb->free_extents, start, end - start);
+		if (ret < 0)
+			return ret;
+	}
+	return 0;
 }
 
 /* returns negative value on error 
- file is name of the disk that was given to testfs.
+ dev is the disk that was given to testfs, opened with one of the
+ backends in dev.h. the super block takes over the caller's reference.
  this function initializes all the in memory data structures maintained by the sb
  block.
  */
-int testfs_init_super_block(const char *file, int corrupt,
+int testfs_init_super_block(struct block_dev *dev, int corrupt,
 		struct super_block **sbp) {
 	struct super_block *sb = malloc(sizeof(struct super_block));
-	char block[BLOCK_SIZE];
-	int ret, sock;
+	int ret;
 
 	if (!sb) {
+		testfs_dev_put(dev);
 		return -ENOMEM;
 	}
+	sb->groups = NULL;
+	sb->bcache = NULL;
+	sb->inode_freemap = NULL;
+	sb->block_freemap = NULL;
+	sb->free_extents = NULL;
+	sb->csum_table = NULL;
+	// the block size is needed to read blocks, so the dsuper_block at
+	// the start of the image is read straight from the device.
+	ret = dev->ops->read(dev, (char *) &sb->sb, 0,
+			sizeof(struct dsuper_block));
+	if (ret < 0)
+		goto fail;
+	ret = testfs_init_geometry(sb);
+	if (ret < 0)
+		goto fail;
+	ret = testfs_attach_dev(sb, dev);
+	if (ret < 0)
+		goto fail;
+	ret = testfs_read_groups(sb);
+	if (ret < 0)
+		goto fail;
 
-	if ((sock = open(file, O_RDWR
-#ifndef DISABLE_OSYNC
-			| O_SYNC
-#endif
-			)) < 0) {
-		return errno;
-	} else if ((sb->dev = fdopen(sock, "r+")) == NULL) {
-		return errno;
-	}
-
-	// sb->dev type = FILE
-	// read from sb into block.
-	read_blocks(sb, block, 0, 1);
-	// copy only 24 bytes from block corresponding to dsuper_block
-	memcpy(&sb->sb, block, sizeof(struct dsuper_block));
-
-	// 64 * 1 * 8
 	// bitmap create will return a inode_bitmap structure.
 	// and point sb->inode_freemap to that structure.
-	// currently the inode bitmap is all 0.
+	// it holds one bit per inode.
 	// at the end of this function, bitmap is created in memory 
-	ret = bitmap_create(BLOCK_SIZE * INODE_FREEMAP_SIZE * BITS_PER_WORD,
-			&sb->inode_freemap);
+	ret = testfs_create_freemap(sb, sb->geo.nr_inodes,
+			sb->geo.inode_freemap_size, &sb->inode_freemap);
 	if (ret < 0)
-		return ret;
+		goto fail;
 	// bitmap_getdata returns v -> the byte array containing bit info
-	// read_blocks reads sb->v into sb at offset freemap_start till 
-	// INODE_FREEMAP_SIZE
-	// sb is only sent to read_blocks since we need the sb device handle.
-	// data from sb->dev is used to populate arg 2  sb->inode_freemap
-	read_blocks(sb, bitmap_getdata(sb->inode_freemap),
-			sb->sb.inode_freemap_start, INODE_FREEMAP_SIZE);
-
-	ret = bitmap_create(BLOCK_SIZE * BLOCK_FREEMAP_SIZE * BITS_PER_WORD,
-			&sb->block_freemap);
+	// testfs_read_table reads the slice of each group into it from
+	// the freemap region of the group.
+	// the bits past nr_inodes are marked in use again afterwards,
+	// and the summary of full regions is rebuilt from what was read.
+	testfs_read_table(sb, TESTFS_INODE_FREEMAP);
+	bitmap_mark_padding(sb->inode_freemap);
+	bitmap_rebuild_summary(sb->inode_freemap);
+
+	ret = testfs_create_freemap(sb, sb->geo.nr_data_blocks,
+			sb->geo.block_freemap_size, &sb->block_freemap);
 	if (ret < 0)
-		return ret;
-	read_blocks(sb, bitmap_getdata(sb->block_freemap),
-			sb->sb.block_freemap_start, BLOCK_FREEMAP_SIZE);
-	sb->csum_table = malloc(CSUM_TABLE_SIZE * BLOCK_SIZE);
-	if (!sb->csum_table)
-		return -ENOMEM;
-	read_blocks(sb, (char *) sb->csum_table, sb->sb.csum_table_start,
-	CSUM_TABLE_SIZE);
+		goto fail;
+	testfs_read_table(sb, TESTFS_BLOCK_FREEMAP);
+	bitmap_mark_padding(sb->block_freemap);
+	bitmap_rebuild_summary(sb->block_freemap);
+	if (sb->geo.allocator == TESTFS_ALLOC_EXTENT) {
+		ret = testfs_build_free_extents(sb);
+		if (ret < 0)
+			goto fail;
+	}
+	sb->csum_table = malloc(testfs_csum_table_size(sb));
+	if (!sb->csum_table) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+	testfs_read_table(sb, TESTFS_CSUM_TABLE);
 	sb->tx_in_progress = TX_NONE;
 	/*
-	 inode_hash_init() initializes inode_hash_table of size 256 bytes
-	 each entry of the inode table contains a first pointer. each
-	 node of the first pointer has a prev pointer and a next pointer.
+	 inode_hash_init() initializes inode_hash_table, starting with 256
+	 buckets, or takes another reference to it if it exists. each
+	 bucket contains a first pointer. each node of the first pointer
+	 has a prev pointer and a next pointer.
 	 */
 	inode_hash_init();
 	*sbp = sb;
 
 	return 0;
+
+fail:
+	if (sb->free_extents)
+		extent_tree_destroy(sb->free_extents);
+	if (sb->block_freemap)
+		bitmap_destroy(sb->block_freemap);
+	if (sb->inode_freemap)
+		bitmap_destroy(sb->inode_freemap);
+	if (sb->bcache)
+		bcache_destroy(sb->bcache);
+	free(sb->groups);
+	free(sb);
+	testfs_dev_put(dev);
+	return ret;
+}
+
+/* make new inodes map their blocks with extents, see inode.h.
+ * returns negative value if the block size is too small for them */
+int testfs_set_extent_inodes(struct super_block *sb) {
+	if (BLOCK_SIZE(sb) < EXTENT_MIN_BLOCK_SIZE)
+		return -EINVAL;
+	sb->extent_inodes = 1;
+	return 0;
 }
 
 /*
@@ -129,10 +447,17 @@ int testfs_init_super_block(const char *file, int corrupt,
  * into buffer block. then send it for writing to write_blocks
  */
 void testfs_write_super_block(struct super_block *sb) {
-	char block[BLOCK_SIZE] = { 0 };
+	char block[BLOCK_SIZE(sb)];
 
-	assert(sizeof(struct dsuper_block) <= BLOCK_SIZE);
+	assert(sizeof(struct dsuper_block) <= BLOCK_SIZE(sb));
+	bzero(block, BLOCK_SIZE(sb));
 	sb->sb.modification_time = time(NULL);
+	// the free counts are recorded so that usage can be read from the
+	// super block alone. they are recomputed from the freemaps at mount.
+	if (sb->inode_freemap)
+		sb->sb.nr_free_inodes = bitmap_nr_free(sb->inode_freemap);
+	if (sb->block_freemap)
+		sb->sb.nr_free_blocks = bitmap_nr_free(sb->block_freemap);
 	memcpy(block, &sb->sb, sizeof(struct dsuper_block));
 	write_blocks(sb, block, 0, 1);
 }
@@ -144,121 +469,150 @@ void testfs_close_super_block(struct super_block *sb) {
 	// assume there are no entries in the inode hash table. 
 	// delete the 256 hash size inode hash table 
 	inode_hash_destroy();
+	// write the changed blocks of the freemaps to disk.
+	testfs_flush_freemaps(sb);
 	if (sb->inode_freemap) {
-		// write inode map to disk.
-		write_blocks(sb, bitmap_getdata(sb->inode_freemap),
-				sb->sb.inode_freemap_start, INODE_FREEMAP_SIZE);
 		// free in memory bitmap file.
 		bitmap_destroy(sb->inode_freemap);
 		sb->inode_freemap = NULL;
 	}
 	if (sb->block_freemap) {
-		// write inode freemap to disk
-		write_blocks(sb, bitmap_getdata(sb->block_freemap),
-				sb->sb.block_freemap_start, BLOCK_FREEMAP_SIZE);
 		// destroy inode freemap
 		bitmap_destroy(sb->block_freemap);
 		sb->block_freemap = NULL;
 	}
+	if (sb->free_extents) {
+		extent_tree_destroy(sb->free_extents);
+		sb->free_extents = NULL;
+	}
 	testfs_tx_commit(sb, TX_UMOUNT);
-	fflush(sb->dev);
-	fclose(sb->dev);
+	flush_blocks(sb);
+	if (sb->bcache)
+		bcache_destroy(sb->bcache);
+	sb->bcache = NULL;
+	testfs_dev_put(sb->dev);
 	sb->dev = NULL;
+	free(sb->groups);
 	// free in memory data structure sb superblock
 	free(sb);
 }
 
-static void testfs_write_inode_freemap(struct super_block *sb, int inode_nr) {
-	char *freemap;
-	int nr;
-
-	assert(sb->inode_freemap);
-	freemap = bitmap_getdata(sb->inode_freemap);
-	nr = inode_nr / (BLOCK_SIZE * BITS_PER_WORD);
-	write_blocks(sb, freemap + (nr * BLOCK_SIZE),
-			sb->sb.inode_freemap_start + nr, 1);
-}
-
-static void testfs_write_block_freemap(struct super_block *sb, int block_nr) {
-	char *freemap;
-	int nr;
+/*
+ * format dev with an empty file system containing only the root directory.
+ * takes over the caller's reference to dev.
+ */
+void testfs_make_fs(struct block_dev *dev,
+		const struct testfs_geometry *geo) {
+	struct super_block *sb;
+	int ret;
 
-	assert(sb->block_freemap);
-	freemap = bitmap_getdata(sb->block_freemap);
-	nr = block_nr / (BLOCK_SIZE * BITS_PER_WORD);
-	write_blocks(sb, freemap + (nr * BLOCK_SIZE),
-			sb->sb.block_freemap_start + nr, 1);
+	/* keep the device alive across the unmount below */
+	testfs_dev_get(dev);
+	sb = testfs_make_super_block(dev, geo);
+	testfs_make_inode_freemap(sb);
+	testfs_make_block_freemap(sb);
+	testfs_make_csum_table(sb);
+	testfs_make_inode_blocks(sb);
+	testfs_close_super_block(sb);
+
+	ret = testfs_init_super_block(dev, 0, &sb);
+	if (ret) {
+		errno = -ret;
+		EXIT("testfs_init_super_block");
+	}
+	testfs_make_root_dir(sb);
+	testfs_close_super_block(sb);
 }
 
-/* return free block number or negative value */
-static int testfs_get_block_freemap(struct super_block *sb) {
+/* return free inode number, preferably in group, or negative value */
+int testfs_get_inode_freemap(struct super_block *sb, int group) {
 	u_int32_t index;
 	int ret;
 
-	assert(sb->block_freemap);
-	ret = bitmap_alloc(sb->block_freemap, &index);
+	ret = testfs_alloc_group(sb, TESTFS_INODE_FREEMAP, group, &index);
 	if (ret < 0)
 		return ret;
-	testfs_write_block_freemap(sb, index);
 	return index;
 }
 
-/* release allocated block */
-static void testfs_put_block_freemap(struct super_block *sb, int block_nr) {
-	assert(sb->block_freemap);
-	bitmap_unmark(sb->block_freemap, block_nr);
-	testfs_write_block_freemap(sb, block_nr);
+/* release allocated inode */
+void testfs_put_inode_freemap(struct super_block *sb, int inode_nr) {
+	assert(sb->inode_freemap);
+	bitmap_unmark(sb->inode_freemap, inode_nr);
 }
 
-/* return free inode number or negative value */
-int testfs_get_inode_freemap(struct super_block *sb) {
-	u_int32_t index;
+/* write the freemap blocks changed since they were last written, each
+ * once. freemap changes reach the disk here, at the end of each
+ * transaction and at unmount, rather than on every change */
+void testfs_flush_freemaps(struct super_block *sb) {
+	testfs_flush_table(sb, TESTFS_INODE_FREEMAP);
+	testfs_flush_table(sb, TESTFS_BLOCK_FREEMAP);
+}
+
+/* allocate a run of up to want contiguous blocks, following block goal
+ * if it is a data block (or 0), otherwise in group. the run is returned
+ * in *got, the blocks are not zeroed.
+ * returns the first block number or negative value on error. */
+int testfs_alloc_blocks(struct super_block *sb, int group, int goal, int want,
+		int *got) {
+	u_int32_t index, n;
 	int ret;
 
-	assert(sb->inode_freemap);
-	ret = bitmap_alloc(sb->inode_freemap, &index);
+	ret = testfs_alloc_group_run(sb, group,
+			goal > 0 ? testfs_data_block_index(sb, goal) : -1, want,
+			&index, &n);
+	// if error occurred, return -ENOSPC
 	if (ret < 0)
 		return ret;
-	testfs_write_inode_freemap(sb, index);
-	return index;
+	*got = n;
+	return testfs_data_block_nr(sb, index);
 }
 
-/* release allocated inode */
-void testfs_put_inode_freemap(struct super_block *sb, int inode_nr) {
-	assert(sb->inode_freemap);
-	bitmap_unmark(sb->inode_freemap, inode_nr);
-	testfs_write_inode_freemap(sb, inode_nr);
+/* release nr blocks from block_nr on that were allocated but never used */
+void testfs_release_blocks(struct super_block *sb, int block_nr, int nr) {
+	int index = testfs_data_block_index(sb, block_nr);
+
+	assert(sb->block_freemap);
+	assert(index >= 0);
+	bitmap_unmark_range(sb->block_freemap, index, nr);
+	if (sb->free_extents &&
+			extent_tree_insert(sb->free_extents, index, nr) < 0) {
+		EXIT("malloc");
+	}
 }
 
-/* allocate a block and return its block number.
+/* allocate a block, preferably in group, and return its block number.
  * returns negative value on error. */
-int testfs_alloc_block(struct super_block *sb, char *block) {
-	int phy_block_nr;
+int testfs_alloc_block(struct super_block *sb, int group, char *block) {
+	int phy_block_nr, got;
 
-	phy_block_nr = testfs_get_block_freemap(sb);
-	// if error occurred, return -ENOSPC
+	phy_block_nr = testfs_alloc_blocks(sb, group, 0, 1, &got);
 	if (phy_block_nr < 0)
 		return phy_block_nr;
-	bzero(block, BLOCK_SIZE);
-	return sb->sb.data_blocks_start + phy_block_nr;
+	bzero(block, BLOCK_SIZE(sb));
+	return phy_block_nr;
 }
 
-/* free a block.
+/* free nr contiguous blocks from block_nr on, in one group.
  * returns negative value on error. */
-int testfs_free_block(struct super_block *sb, int block_nr) {
+int testfs_free_blocks(struct super_block *sb, int block_nr, int nr) {
 
-	zero_blocks(sb, block_nr, 1);
-	block_nr -= sb->sb.data_blocks_start;
-	assert(block_nr >= 0);
-	testfs_put_block_freemap(sb, block_nr);
+	zero_blocks(sb, block_nr, nr);
+	testfs_release_blocks(sb, block_nr, nr);
 	return 0;
 }
 
+/* free a block.
+ * returns negative value on error. */
+int testfs_free_block(struct super_block *sb, int block_nr) {
+	return testfs_free_blocks(sb, block_nr, 1);
+}
+
 static int testfs_checkfs(struct super_block *sb, struct bitmap *i_freemap,
 		struct bitmap *b_freemap, int inode_nr) {
 	struct inode *in = testfs_get_inode(sb, inode_nr);
 	int size;
-	int size_roundup = ROUNDUP(testfs_inode_get_size(in), BLOCK_SIZE);
+	int size_roundup = ROUNDUP(testfs_inode_get_size(in), BLOCK_SIZE(sb));
 
 	assert((testfs_inode_get_type(in) == I_FILE) || (testfs_inode_get_type(in) == I_DIR));
 
@@ -281,32 +635,107 @@ static int testfs_checkfs(struct super_block *sb, struct bitmap *i_freemap,
 	return 0;
 }
 
+/* report the runs of entries that differ between freemap, as kept by the
+ * file system, and in_use, the entries found in use. with repair, make
+ * freemap match in_use. returns the nr of entries that differ */
+static int testfs_check_freemap(struct bitmap *freemap, struct bitmap *in_use,
+		const char *what, int repair) {
+	u_int32_t from = 0, start, end;
+	int leaked, nr = 0;
+
+	while (bitmap_next_diff(freemap, in_use, from, &start, &end,
+				&leaked) == 0) {
+		if (end - start == 1)
+			printf("%s %u", what, start);
+		else
+			printf("%ss %u-%u", what, start, end - 1);
+		if (leaked)
+			printf(": allocated but not in use (leaked)\n");
+		else
+			printf(": in use but free (may be allocated twice)\n");
+		if (repair && leaked)
+			bitmap_unmark_range(freemap, start, end - start);
+		else if (repair)
+			bitmap_mark_range(freemap, start, end - start);
+		nr += end - start;
+		from = end;
+	}
+	return nr;
+}
+
 int cmd_checkfs(struct super_block *sb, struct context *c) {
 	struct bitmap *i_freemap, *b_freemap;
+	int repair = 0;
 	int ret;
 
-	if (c->nargs != 1) {
+	if (c->nargs == 2 && strcmp(c->cmd[1], "repair") == 0) {
+		repair = 1;
+	} else if (c->nargs != 1) {
 		return -EINVAL;
 	}
-	ret = bitmap_create(BLOCK_SIZE * INODE_FREEMAP_SIZE * BITS_PER_WORD,
-			&i_freemap);
+	ret = bitmap_create(sb->geo.nr_inodes, &i_freemap);
 	if (ret < 0)
 		return ret;
-	ret = bitmap_create(BLOCK_SIZE * BLOCK_FREEMAP_SIZE * BITS_PER_WORD,
-			&b_freemap);
-	if (ret < 0)
+	ret = bitmap_create(sb->geo.nr_data_blocks, &b_freemap);
+	if (ret < 0) {
+		bitmap_destroy(i_freemap);
 		return ret;
+	}
 	testfs_checkfs(sb, i_freemap, b_freemap, 0);
 
 	if (!bitmap_equal(sb->inode_freemap, i_freemap)) {
 		printf("inode freemap is not consistent\n");
+		testfs_check_freemap(sb->inode_freemap, i_freemap, "inode",
+				repair);
 	}
 	if (!bitmap_equal(sb->block_freemap, b_freemap)) {
 		printf("block freemap is not consistent\n");
+		testfs_check_freemap(sb->block_freemap, b_freemap,
+				"data block", repair);
+		/* the free extents follow the repaired freemap */
+		if (repair && sb->free_extents) {
+			extent_tree_destroy(sb->free_extents);
+			sb->free_extents = NULL;
+			ret = testfs_build_free_extents(sb);
+			if (ret < 0)
+				return ret;
+		}
+	}
+	if (repair) {
+		testfs_flush_freemaps(sb);
 	}
+	bitmap_destroy(i_freemap);
+	bitmap_destroy(b_freemap);
 	printf("nr of allocated inodes = %d\n",
 			bitmap_nr_allocated(sb->inode_freemap));
 	printf("nr of allocated blocks = %d\n",
 			bitmap_nr_allocated(sb->block_freemap));
 	return 0;
 }
+
+/* report the usage of inodes and data blocks, from the counts kept by the
+ * freemaps */
+int cmd_df(struct super_block *sb, struct context *c) {
+	int nr_inodes = sb->geo.nr_inodes;
+	int nr_blocks = sb->geo.nr_data_blocks;
+	int free_inodes, free_blocks;
+
+	if (c->nargs != 1) {
+		return -EINVAL;
+	}
+	free_inodes = bitmap_nr_free(sb->inode_freemap);
+	free_blocks = bitmap_nr_free(sb->block_freemap);
+	printf("%-8s %10s %10s %10s %5s\n", "", "total", "used", "free",
+			"use%");
+	printf("%-8s %10d %10d %10d %4d%%\n", "inodes", nr_inodes,
+			nr_inodes - free_inodes, free_inodes,
+			(int) (100LL * (nr_inodes - free_inodes) / nr_inodes));
+	printf("%-8s %10d %10d %10d %4d%%\n", "blocks", nr_blocks,
+			nr_blocks - free_blocks, free_blocks,
+			(int) (100LL * (nr_blocks - free_blocks) / nr_blocks));
+	if (sb->free_extents) {
+		printf("free extents = %u\n",
+				extent_tree_nr_extents(sb->free_extents));
+	}
+	return 0;
+}
@@ -3,7 +3,24 @@
 
 #include <stdio.h>
 #include <time.h>
+#include <sys/types.h>
 #include "tx.h"
+#include "iostat.h"
+
+struct block_dev;
+struct bcache;
+struct dgroup_desc;
+struct extent_tree;
+
+/* default readahead window of sequential inode reads, in blocks */
+#define RA_DEFAULT_WINDOW 8
+
+/* data block allocators, chosen at mkfs time. both keep the block
+ * freemap on disk up to date */
+enum testfs_allocator {
+        TESTFS_ALLOC_BITMAP,    /* next-fit search of the block freemap */
+        TESTFS_ALLOC_EXTENT,    /* best fit from a tree of free extents */
+};
 
 struct dsuper_block {
         int inode_freemap_start;
@@ -12,34 +29,87 @@ struct dsuper_block {
         int inode_blocks_start;
         int data_blocks_start;
         time_t modification_time;
+        int block_size;         /* 0 in old images, which use 64 */
+        int nr_inodes;          /* 0 in old images, see testfs_init_geometry */
+        int nr_data_blocks;
+        int nr_groups;          /* 0 in ungrouped images, see group.h */
+        int inodes_per_group;
+        int blocks_per_group;
+        int nr_free_inodes;     /* as of the last unmount, 0 in old images */
+        int nr_free_blocks;
+        int allocator;          /* enum testfs_allocator, 0 in old images */
 } __attribute__((packed));
 
+/* file system geometry. the block size, the inode and data block counts
+ * and the group size are chosen at mkfs time, the region sizes (in blocks,
+ * per group) follow from them. the data block allocator is chosen along
+ * with them. */
+struct testfs_geometry {
+        int block_size;
+        int nr_inodes;
+        int nr_data_blocks;
+        int nr_groups;
+        int inodes_per_group;
+        int blocks_per_group;
+        int group_desc_size;    /* 0 in ungrouped images */
+        int inode_freemap_size;
+        int block_freemap_size;
+        int csum_table_size;
+        int nr_inode_blocks;
+        enum testfs_allocator allocator;
+};
+
 struct super_block {
         struct dsuper_block sb;
-        FILE *dev;
+        struct testfs_geometry geo;
+        struct dgroup_desc *groups;
+        struct block_dev *dev;
+        struct bcache *bcache;
         struct bitmap *inode_freemap;
         struct bitmap *block_freemap;
+        struct extent_tree *free_extents; /* NULL with TESTFS_ALLOC_BITMAP */
         tx_type tx_in_progress;    
+        struct iostat iostat;      /* block I/O statistics */
+        int ra_window;             /* readahead blocks, 0 disables */
+        int extent_inodes;         /* new inodes map their blocks with
+                                      extents, see inode.h */
 
         // TODO: add your code here
         int *csum_table;
 };
 
-struct super_block *testfs_make_super_block(char *file);
+/* block size of the mounted file system */
+#define BLOCK_SIZE(sb) ((sb)->geo.block_size)
+
+int testfs_block_size_valid(int block_size);
+void testfs_default_geometry(int block_size, struct testfs_geometry *geo);
+int testfs_layout_geometry(struct testfs_geometry *geo);
+int testfs_fit_geometry(struct testfs_geometry *geo, off_t size);
+struct super_block *
+testfs_make_super_block(struct block_dev *dev,
+                        const struct testfs_geometry *geo);
 void testfs_make_inode_freemap(struct super_block *sb);
 void testfs_make_block_freemap(struct super_block *sb);
 void testfs_make_csum_table(struct super_block *sb);
 void testfs_make_inode_blocks(struct super_block *sb);
 
-int testfs_init_super_block(const char *file, int corrupt, 
+int testfs_init_super_block(struct block_dev *dev, int corrupt, 
     struct super_block **sbp);
+int testfs_set_extent_inodes(struct super_block *sb);
 void testfs_write_super_block(struct super_block *sb);
 void testfs_close_super_block(struct super_block *sb);
+void testfs_make_fs(struct block_dev *dev,
+                    const struct testfs_geometry *geo);
 
-int testfs_get_inode_freemap(struct super_block *sb);
+int testfs_get_inode_freemap(struct super_block *sb, int group);
 void testfs_put_inode_freemap(struct super_block *sb, int inode_nr);
+void testfs_flush_freemaps(struct super_block *sb);
 
-int testfs_alloc_block(struct super_block *sb, char *block);
+int testfs_alloc_blocks(struct super_block *sb, int group, int goal, int want,
+                       int *got);
+void testfs_release_blocks(struct super_block *sb, int block_nr, int nr);
+int testfs_alloc_block(struct super_block *sb, int group, char *block);
+int testfs_free_blocks(struct super_block *sb, int block_nr, int nr);
 int testfs_free_block(struct super_block *sb, int block_nr);
 
 #endif /* _SUPER_H */
@@ -19,6 +19,8 @@
 #include "inode.h"
 #include "dir.h"
 #include "tx.h"
+#include "dev.h"
+#include "bcache.h"
 
 #define KLEE
 
@@ -54,7 +56,10 @@ static struct {
         { "write",      cmd_write,      2, },
 		{ "owrite",     cmd_owrite,		3, },
 		{ "oread",      cmd_oread,		3, },
-        { "checkfs",    cmd_checkfs,    1, },
+        { "checkfs",    cmd_checkfs,    2, },
+        { "df",         cmd_df,         1, },
+        { "iostat",     cmd_iostat,     2, },
+        { "icache",     cmd_icache,     1, },
         { "quit",    	cmd_quit,       1, },
         { NULL,         NULL}
 };
@@ -143,18 +148,29 @@ static void handle_command(struct super_block *sb, struct context *c,
 }
 
 static void usage(const char * progname) {
-	fprintf(stdout, "Usage: %s [-ch][--help] rawfile\n", progname);
+	fprintf(stdout, "Usage: %s [-bcdhmrux][-a nr][-C nr][-I nr][--barrier][--direct][--extents][--help][--mmap][--ramdisk][--uring][--cache nr][--icache nr][--readahead nr] rawfile\n", progname);
+	fprintf(stdout, "  -x: new files map their blocks with extents, the block size must be %d or more\n",
+			EXTENT_MIN_BLOCK_SIZE);
 	exit(1);
 }
 
 struct args {
 	const char * disk;  // name of disk
 	int corrupt;        // to corrupt or not
+	int ramdisk;        // run on a freshly formatted RAM disk
+	int cache_size;     // nr of buffer cache blocks, -1 for default
+	int ra_window;      // readahead window in blocks, -1 for default
+	int icache_size;    // nr of unreferenced inodes kept, -1 for default
+	int dev_flags;      // BDEV_* flags for the image file
+	int mmap;           // access the image through a shared mapping
+	int direct;         // access the image with O_DIRECT
+	int extents;        // new inodes map their blocks with extents
 };
 
 static struct args *
 parse_arguments(int argc, char * const argv[]) {
-	static struct args args = { 0 };
+	static struct args args = { .cache_size = -1, .ra_window = -1,
+		.icache_size = -1 };
 // struct options -
 // name of the option. 
 // has arg {no_argument, required_argument, optional_argument}
@@ -162,7 +178,16 @@ parse_arguments(int argc, char * const argv[]) {
 // flag ptr - non null - address of int variable which is flag for the option
 // val - c or h
 	static struct option long_options[] = { { "corrupt", no_argument, 0, 'c' },
-			{ "help", no_argument, 0, 'h' }, { 0, 0, 0, 0 }, };
+			{ "barrier", no_argument, 0, 'b' },
+			{ "direct", no_argument, 0, 'd' },
+			{ "extents", no_argument, 0, 'x' },
+			{ "help", no_argument, 0, 'h' },
+			{ "mmap", no_argument, 0, 'm' },
+			{ "ramdisk", no_argument, 0, 'r' },
+			{ "uring", no_argument, 0, 'u' },
+			{ "cache", required_argument, 0, 'C' },
+			{ "icache", required_argument, 0, 'I' },
+			{ "readahead", required_argument, 0, 'a' }, { 0, 0, 0, 0 }, };
 	int running = 1;
 
 	while (running) {
@@ -170,19 +195,52 @@ parse_arguments(int argc, char * const argv[]) {
 		// getopt_long - decode options from argv.
 		// getopt_long (int argc, char *const *argv, const char *shortopts, const struct option *longopts, int *indexptr)
 		//
-		int c = getopt_long(argc, argv, "ch", long_options, &option_index);
+		int c = getopt_long(argc, argv, "a:bcdhmruxC:I:", long_options, &option_index);
 		switch (c) {
 		case -1:
 			running = 0;
 			break;
 		case 0:
 			break;
+		case 'a':
+			args.ra_window = atoi(optarg);
+			if (args.ra_window < 0)
+				usage(argv[0]);
+			break;
+		case 'b':
+			args.dev_flags |= BDEV_BARRIER;
+			break;
 		case 'c':
 			args.corrupt = 1;
 			break;
+		case 'd':
+			args.direct = 1;
+			break;
 		case 'h':
 			usage(argv[0]);
 			break;
+		case 'm':
+			args.mmap = 1;
+			break;
+		case 'r':
+			args.ramdisk = 1;
+			break;
+		case 'u':
+			args.dev_flags |= BDEV_URING;
+			break;
+		case 'x':
+			args.extents = 1;
+			break;
+		case 'C':
+			args.cache_size = atoi(optarg);
+			if (args.cache_size < 0)
+				usage(argv[0]);
+			break;
+		case 'I':
+			args.icache_size = atoi(optarg);
+			if (args.icache_size < 0)
+				usage(argv[0]);
+			break;
 		case '?':
 			usage(argv[0]);
 			break;
@@ -200,6 +258,7 @@ parse_arguments(int argc, char * const argv[]) {
 
 int main(int argc, char * const argv[]) {
 	struct super_block *sb;
+	struct block_dev *dev;
         char line[1000];
         int ret;
         struct context c;
@@ -212,10 +271,48 @@ int main(int argc, char * const argv[]) {
        // initializes the in memory structure sb with data that is 
        // read from the disk. after successful execution, we have 
        // sb initialized to dsuper_block read from disk.
-       ret = testfs_init_super_block("/tmp/file", args->corrupt, &sb);
+       // with --ramdisk, the command runs on an empty file system that
+       // is formatted in memory and never touches the disk.
+       if (args->ramdisk) {
+               ret = testfs_dev_create_ram(0, &dev);
+               if (ret == 0) {
+                       struct testfs_geometry geo;
+
+                       testfs_dev_get(dev);
+                       testfs_default_geometry(DEFAULT_BLOCK_SIZE, &geo);
+                       testfs_make_fs(dev, &geo);
+               }
+       } else if (args->direct) {
+               ret = testfs_dev_open_direct("/tmp/file", args->dev_flags, &dev);
+       } else if (args->mmap) {
+               ret = testfs_dev_open_mmap("/tmp/file", args->dev_flags, &dev);
+       } else {
+               ret = testfs_dev_open_file("/tmp/file", args->dev_flags, &dev);
+       }
+       if (ret) {
+               errno = -ret;
+               EXIT("testfs_dev_open");
+       }
+       ret = testfs_init_super_block(dev, args->corrupt, &sb);
        //fslice_clear();       
        if (ret) {
                EXIT("testfs_init_super_block");
+       }
+       if (args->cache_size >= 0 && sb->bcache) {
+               bcache_resize(sb->bcache, args->cache_size);
+       }
+       if (args->ra_window >= 0) {
+               sb->ra_window = args->ra_window;
+       }
+       if (args->icache_size >= 0) {
+               inode_cache_resize(args->icache_size);
+       }
+       if (args->extents) {
+               ret = testfs_set_extent_inodes(sb);
+               if (ret) {
+                       errno = -ret;
+                       EXIT("testfs_set_extent_inodes");
+               }
        }
         /* if the inode does not exist in the inode_hash_map (which
          is an inmemory map of all inode blocks, create a new inode by
@@ -225,7 +322,7 @@ int main(int argc, char * const argv[]) {
         c.cur_dir = testfs_get_inode(sb, 0); /* root dir */
 	int paramNo, offset = 0;
 	printf("argc = %d\n", argc);
-	for(paramNo = 1 ; paramNo < argc ; paramNo ++){
+	for(paramNo = optind ; paramNo < argc ; paramNo ++){
 		printf("param = %d\n", paramNo);
 		printf("offset = %d\n",offset);
 		printf("argument being copied = %s\n", argv[paramNo]);
@@ -4,8 +4,15 @@
 #include <unistd.h>
 #include "common.h"
 
-#define BLOCK_SIZE 64
-
+/* the block size of an image is chosen at mkfs time and recorded in the
+ * super block, see BLOCK_SIZE(sb). it is a power of two in this range. */
+#define MIN_BLOCK_SIZE     64
+#define MAX_BLOCK_SIZE  65536
+#define DEFAULT_BLOCK_SIZE MIN_BLOCK_SIZE
+
+/* default geometry, which is also the layout of images created before the
+ * geometry was recorded in the super block. region sizes in blocks, start
+ * offsets for 64 byte blocks. */
 #define SUPER_BLOCK_SIZE    1           /* start 0x0000 */
 #define INODE_FREEMAP_SIZE  1           /* start 0x0040 */
 #define BLOCK_FREEMAP_SIZE  2           /* start 0x0080 */
@@ -13,6 +20,9 @@
 #define NR_INODE_BLOCKS   128           /* start 0x1000 */
 #define NR_DATA_BLOCKS    512           /* start 0x3000 */
 
+/* data blocks per inode when mktestfs sizes the image to fit a file */
+#define INODE_RATIO         2
+
 struct super_block;
 struct inode;
 
@@ -40,5 +50,8 @@ int cmd_owrite(struct super_block *, struct context *c);
 int cmd_oread(struct super_block *, struct context *c);
 
 int cmd_checkfs(struct super_block *, struct context *c);
+int cmd_df(struct super_block *, struct context *c);
+int cmd_iostat(struct super_block *, struct context *c);
+int cmd_icache(struct super_block *, struct context *c);
 
 #endif /* _TESTFS_H */
@@ -1,6 +1,8 @@
 #include <assert.h>
 #include "super.h"
 #include "tx.h"
+#include "block.h"
+#include "inode.h"
 
 char *tx_type_array[] = {"TX_NONE",
                          "TX_WRITE",
@@ -19,5 +21,14 @@ void
 testfs_tx_commit(struct super_block *sb, tx_type type)
 {
         assert(sb->tx_in_progress == type);
+        /* the inodes synced by this transaction are written back here,
+         * each inode block once */
+        testfs_flush_inodes(sb);
+        /* the freemap blocks changed by this transaction are written once
+         * here, rather than on every allocation */
+        testfs_flush_freemaps(sb);
+        /* write back the blocks dirtied by this transaction. this is also
+         * the durability barrier: one device flush per transaction */
+        flush_blocks(sb);
         sb->tx_in_progress = TX_NONE;
 }
@@ -0,0 +1,201 @@
+/*
+ * Minimal io_uring ring.
+ * See uring.h for more information.
+ */
+
+#include "common.h"
+#include "dev.h"
+#include "uring.h"
+
+#if defined(__linux__) && !defined(DISABLE_IO_URING)
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int ring_fd;
+	int fd;                         /* image descriptor */
+	unsigned depth;
+	/* submission queue */
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	struct io_uring_sqe *sqes;
+	/* completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	/* mappings */
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p) {
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int ring_fd, unsigned to_submit,
+		unsigned min_complete, unsigned flags) {
+	return (int) syscall(__NR_io_uring_enter, ring_fd, to_submit,
+			min_complete, flags, NULL, 0);
+}
+
+static void uring_unmap(struct uring *r) {
+	if (r->sqes != MAP_FAILED)
+		munmap(r->sqes, r->sqes_size);
+	if (r->cq_ring != MAP_FAILED && r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	if (r->sq_ring != MAP_FAILED)
+		munmap(r->sq_ring, r->sq_ring_size);
+}
+
+/* return negative value on error */
+int uring_create(int fd, unsigned depth, struct uring **rp) {
+	struct io_uring_params p;
+	struct uring *r;
+	int ret;
+
+	if ((r = malloc(sizeof(struct uring))) == NULL)
+		return -ENOMEM;
+	bzero(&p, sizeof(p));
+	if ((r->ring_fd = io_uring_setup(depth, &p)) < 0) {
+		ret = -errno;
+		free(r);
+		return ret;
+	}
+	r->fd = fd;
+	r->depth = p.sq_entries;
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->sq_ring_size = MAX(r->sq_ring_size, r->cq_ring_size);
+		r->cq_ring_size = r->sq_ring_size;
+	}
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		r->cq_ring = r->sq_ring;
+	} else {
+		r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, r->ring_fd,
+				IORING_OFF_CQ_RING);
+	}
+	r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, r->ring_fd, IORING_OFF_SQES);
+	if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED
+			|| r->sqes == MAP_FAILED) {
+		ret = -errno;
+		uring_unmap(r);
+		close(r->ring_fd);
+		free(r);
+		return ret;
+	}
+	r->sq_tail = (unsigned *) ((char *) r->sq_ring + p.sq_off.tail);
+	r->sq_mask = (unsigned *) ((char *) r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *) ((char *) r->sq_ring + p.sq_off.array);
+	r->cq_head = (unsigned *) ((char *) r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned *) ((char *) r->cq_ring + p.cq_off.tail);
+	r->cq_mask = (unsigned *) ((char *) r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) ((char *) r->cq_ring + p.cq_off.cqes);
+	*rp = r;
+	return 0;
+}
+
+/* fill one submission queue entry per request */
+static void uring_queue(struct uring *r, struct dev_req *reqs, int first,
+		int nr) {
+	unsigned tail = *r->sq_tail;
+	int i;
+
+	for (i = first; i < first + nr; i++, tail++) {
+		unsigned idx = tail & *r->sq_mask;
+		struct io_uring_sqe *sqe = &r->sqes[idx];
+
+		bzero(sqe, sizeof(*sqe));
+		sqe->opcode = reqs[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = r->fd;
+		sqe->addr = (unsigned long) reqs[i].iov;
+		sqe->len = reqs[i].iovcnt;
+		sqe->off = reqs[i].pos;
+		sqe->user_data = i;
+		r->sq_array[idx] = idx;
+	}
+	/* publish the entries before the kernel sees the new tail */
+	__atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+}
+
+/* reap nr completions */
+static int uring_reap(struct uring *r, struct dev_req *reqs, int nr) {
+	struct io_uring_cqe *cqe;
+	int ret;
+
+	while (nr > 0) {
+		unsigned head = *r->cq_head;
+
+		if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+			ret = io_uring_enter(r->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+			if (ret < 0 && errno != EINTR)
+				return -errno;
+			continue;
+		}
+		cqe = &r->cqes[head & *r->cq_mask];
+		reqs[cqe->user_data].res = cqe->res;
+		__atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+		nr--;
+	}
+	return 0;
+}
+
+int uring_submit(struct uring *r, struct dev_req *reqs, int nr) {
+	unsigned batch, submitted;
+	int done, ret;
+
+	for (done = 0; done < nr; done += batch) {
+		batch = MIN((unsigned) (nr - done), r->depth);
+		submitted = 0;
+
+		uring_queue(r, reqs, done, batch);
+		while (submitted < batch) {
+			ret = io_uring_enter(r->ring_fd, batch - submitted,
+					batch - submitted, IORING_ENTER_GETEVENTS);
+			if (ret < 0) {
+				if (errno == EINTR)
+					continue;
+				return -errno;
+			}
+			submitted += ret;
+		}
+		if ((ret = uring_reap(r, reqs, batch)) < 0)
+			return ret;
+	}
+	return 0;
+}
+
+void uring_destroy(struct uring *r) {
+	uring_unmap(r);
+	close(r->ring_fd);
+	free(r);
+}
+
+#else /* no io_uring */
+
+int uring_create(int fd, unsigned depth, struct uring **rp) {
+	return -ENOSYS;
+}
+
+int uring_submit(struct uring *r, struct dev_req *reqs, int nr) {
+	return -ENOSYS;
+}
+
+void uring_destroy(struct uring *r) {
+}
+
+#endif
@@ -0,0 +1,30 @@
+#ifndef _URING_H
+#define _URING_H
+
+/*
+ * Minimal io_uring submission/completion ring, used by the file backend
+ * to overlap the requests of a batch.
+ *
+ * Talks to the kernel through the raw system calls, so it needs no
+ * library beyond the kernel headers. Building with DISABLE_IO_URING (or
+ * on a non-Linux system) leaves only stubs that return -ENOSYS.
+ *
+ * Functions:
+ *     uring_create  - set up a ring of depth entries for descriptor fd.
+ *                     Returns negative value on error.
+ *     uring_submit  - queue all nr requests, submitting up to depth at a
+ *                     time, and reap their completions into reqs[i].res.
+ *                     Returns negative value if the ring itself fails.
+ *     uring_destroy - tear down the ring.
+ */
+
+#define URING_DEPTH 64
+
+struct uring;
+struct dev_req;
+
+int  uring_create(int fd, unsigned depth, struct uring **rp);
+int  uring_submit(struct uring *r, struct dev_req *reqs, int nr);
+void uring_destroy(struct uring *r);
+
+#endif /* _URING_H */